@@ -7,13 +7,21 @@
 #include<ctype.h>
 #include<errno.h>
 #include<fcntl.h>
+#include<limits.h>
 #include<stdarg.h>
+#include<stddef.h>
 #include<stdint.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
+#include<poll.h>
+#include<pthread.h>
+#include<signal.h>
 #include<sys/ioctl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
 #include<sys/types.h>
+#include<sys/uio.h>
 #include<termios.h>
 #include<time.h>
 #include<unistd.h>
@@ -24,6 +32,38 @@
 
 #define ENABLE_LINE_NUM (1 << 0)
 #define ENABLE_AUTO_INDENT (1 << 1)
+#define ENABLE_FRAME_STATS (1 << 2)
+
+#define MAP_INDEX_SLICE (1 << 20)  //bytes of the mapped file indexed per step
+#define RENDER_CACHE_SLACK 64        //rendered rows kept beyond two screens before trimming
+#define SCREEN_MERGE_GAP 6           //unchanged cells rewritten rather than jumped over
+#define SYNTAX_IDLE_SLICE 1024       //stale rows rehighlighted per step while idle
+#define SYNTAX_LOAD_AHEAD 256        //rows loaded in order rather than waiting for the background pass
+#define HL_WORKER_BATCH 4096         //lines the background pass scans between publishing
+#define HL_WORKER_BLOCK 65536        //line states the background pass allocates at a time
+#define SEARCH_FALSE_HITS 16         //first-byte candidates that may fail before switching to Horspool
+#define MATCH_SET_MAX (1 << 20)      //matches collected before a search stops counting
+#define SEARCH_CHUNK_MIN (256 << 10) //bytes of text below which a search chunk isn't split further
+#define SEARCH_PARALLEL_MIN (4 << 20) //bytes of text below which searching isn't worth the threads
+#define RE_DFA_STATES 1024           //states a lazily built DFA keeps before it starts over
+#define SAVE_BATCH 1024              //pieces of text handed to one writev, the IOV_MAX of Linux
+#define SAVE_IN_PLACE_MAX (64 << 20) //bytes past the first edit above which the file is saved whole
+#define SAVE_IN_PLACE_MIN (16 << 20) //bytes before the first edit below which the file is saved whole
+#define SAVE_IN_PLACE_SHARE 16       //the part saved in place is at most this fraction of the file
+#define INPUT_BUF_SIZE 4096          //bytes of keyboard input taken from the terminal by one read
+#define INPUT_ESC_WAIT 100           //ms the rest of an escape sequence may lag behind its ESC
+#define INPUT_PASTE_WAIT 1000        //ms a paste may stall before what came of it is taken as all of it
+#define BENCH_OPS 32                 //kinds of operation the bench keeps apart
+#define BENCH_SLOWEST 10             //slowest keys of a replay listed with where they are in the log
+#define KEY_LOG_MAGIC "kilo keys 1\n"
+#define PERF_BUCKETS 32              //power of two buckets of a perf histogram
+#define PERF_DEPTH 16                //phases that can be nested
+#define PERF_FILE "kilo-perf.log"    //where the perf histograms are added on exit
+#define TRACE_RING (1 << 17)         //trace events the main thread keeps, the oldest are overwritten
+#define TRACE_WORKER_RING (1 << 13)  //and the others, of which there is a search thread per core
+#define ROW_LONG (64 << 10)          //bytes above which a row is indexed for columns and highlighting
+#define ROW_SEGMENT 4096             //bytes between the marks of a long row
+#define ROW_SCAN_REACH 16            //bytes a token may run past its start besides the longest keyword
 
 #define CTRL_KEY(k) ((k) & 0x1f)  //a bit mask that sets bits 5 and 6 bits of the character to 0, which is exactly how CTRL works
 enum editorKey {
@@ -36,7 +76,8 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_KEY  //the start of a bracketed paste, its text is read with editor_read_paste
 };
 
 enum editor_highlight {
@@ -50,12 +91,20 @@ enum editor_highlight {
     HL_MATCH
 };
 
+#define HL_INVERSE 0x80  //cell flag for reverse video, or'ed into the highlight class
+
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
 typedef int bool;
 /*** data ***/
 
+struct syntax_keyword {
+    char *word;
+    int len;
+    int hl;
+};
+
 struct editor_syntax {
     char *filetype;
     char **filematch;
@@ -64,18 +113,328 @@ struct editor_syntax {
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    //the keywords hashed by their first and last letter and length, built when the syntax is first selected
+    struct syntax_keyword *kwtab;
+    unsigned int kwmask;
+    int kwmin, kwmax;
 };
 
 typedef struct erow {
-    int idx;
     int size;
     int rsize;
     char *chars;  //raw text
     char *render;  //rendered text
+    int roff, rcols;  //a long row renders only the columns [roff, roff + rcols) on screen, rcols is 0 when it's whole
     unsigned char *hl;
     bool hl_open_comment;
+    bool hl_stale;  //the comment state of the row above changed since this row was scanned
+    bool hl_pending;  //hl_open_comment is still to be worked out, no row below has needed it yet
+    bool mapped;  //chars points into the mapped file and must be copied before editing
+    unsigned int frozen;  //the save writing out chars, which are copied before editing while it runs
+    unsigned int drawn;  //last frame the row was on screen
+    int cap;  //bytes allocated for chars when it's known to be more than size + 1
+    struct row_index *index;  //marks of a long row, NULL until it's needed
 }erow;
 
+//where the highlighter stands between two tokens, enough to start it again from there
+struct hl_state {
+    bool in_comment;
+    char in_string;
+    bool prev_sep;
+    bool line_comment;  //a single line comment runs to the end of the row
+    unsigned char prev_hl;
+};
+
+//a long row is marked every ROW_SEGMENT bytes or so with the column and the highlighter state
+//there, so that finding a column or rehighlighting after an edit starts from the nearest mark
+//rather than from the start of the row
+struct row_mark {
+    int cx;
+    int rx;
+    struct hl_state st;
+};
+
+struct row_index {
+    struct row_mark *m;
+    int n, cap;
+    int valid;     //marks [0, valid) are right, the rest were only moved along by an edit
+    bool start;    //comment state at the start of the row the marks were made for
+    bool complete; //end holds the state at the end of the row
+    bool edited;   //the last change of the row moved the marks itself
+    struct hl_state end;
+};
+
+//rows are kept in an implicit treap ordered by position, so that inserting, deleting
+//and looking up a row costs O(log n) instead of shifting and renumbering a flat array
+typedef struct row_node {
+    struct row_node *left, *right, *parent;
+    unsigned int priority;
+    int count;  //number of rows in this subtree
+    int span;   //0 for a loaded row, otherwise the number of mapped lines not loaded yet
+    int line;   //first mapped line of the span
+    erow row;
+}row_node;
+
+//the opened file is mapped read-only and split into lines lazily,
+//lines only become rows when they are looked at
+struct file_map {
+    char *data;
+    size_t len;
+    size_t scanned;  //bytes searched for newlines so far
+    size_t *eol;     //offset of the end of each line found so far
+    int nlines;
+    int cap;
+    bool heap;       //data was malloc'ed instead of mmap'ed
+    bool cr;         //a line found so far ends in \r, which saving turns into a plain \n
+    struct stat st;  //the file that was mapped, to tell whether it's still the one on disk
+};
+
+//a thread that runs the highlighter over the mapped text, which never changes, and publishes the
+//comment state at the start of every line. a row far down the file then gets its state from there
+//instead of from every row above it, for as long as the rows above still produce that state
+struct hl_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    bool running;  //the thread was started and not joined yet
+    bool stop;
+    bool done;     //every line has been scanned
+    char *data;
+    size_t len;
+    unsigned char **start; //comment state at the start of each mapped line, in blocks of HL_WORKER_BLOCK
+    size_t nblocks;
+    int known;             //lines whose state is published, guarded by lock
+};
+
+#define ROW_NODE(r) ((row_node *)((char *)(r) - offsetof(row_node, row)))
+
+//the frame being drawn and the one the terminal is showing, only the difference is sent.
+//every cell is a character and its highlight class, kept in separate arrays so that
+//runs of characters can be copied out as they are
+struct screen {
+    char *chars;
+    unsigned char *hl;
+    char *shadow_chars;
+    unsigned char *shadow_hl;
+    int rows;
+    int cols;
+    int rowoff;  //row offset of the text in the shadow
+    bool valid;  //shadow matches the terminal
+};
+
+//a regular expression reads the line as symbols: its bytes, with one symbol for the start
+//of the line before them and one for the end after them, which is what ^ and $ match
+#define RE_BOL 256
+#define RE_EOL 257
+#define RE_SYMBOLS 258
+#define RE_SET_WORDS ((RE_SYMBOLS + 31) / 32)
+
+enum regex_op {
+    RE_SET,    //one symbol out of a set
+    RE_CAT,
+    RE_ALT,
+    RE_STAR,
+    RE_PLUS,
+    RE_QUEST,
+    RE_EMPTY
+};
+
+struct regex_node {
+    int op;
+    int a, b;  //children
+    unsigned int set[RE_SET_WORDS];
+};
+
+//a state of the NFA either reads a symbol of set and goes on to out,
+//or goes on to out and out1 without reading anything
+enum regex_state_kind {
+    RE_READ,
+    RE_SPLIT,
+    RE_MATCH
+};
+
+struct regex_state {
+    int kind;
+    int out, out1;
+    unsigned int set[RE_SET_WORDS];
+};
+
+struct regex_nfa {
+    struct regex_state *s;
+    int n;
+    int cap;
+    int start;
+};
+
+//the parsed pattern with an NFA reading the line forwards and one reading it backwards,
+//never changed after compiling, so the search threads share it
+struct regex {
+    struct regex_node *nodes;
+    int nnodes;
+    int cap;
+    struct regex_nfa fwd, rev;
+    char *lit;  //text without spaces that every match contains, for skipping lines
+    int litlen;
+};
+
+//a DFA whose states are sets of NFA states, built only as the text reaches them.
+//when it has RE_DFA_STATES states it forgets them all and starts over
+struct regex_dfa {
+    struct regex_nfa *nfa;
+    bool unanchored;  //a match may start anywhere, the NFA's start is added at every step
+    int n;
+    int cap;
+    int *next;        //RE_SYMBOLS transitions per state, -1 until worked out
+    bool *accept;
+    int *off, *size;  //the NFA states of each state, in pool
+    int *pool;
+    int pooln;
+    int poolcap;
+    int *hash;        //state in each slot, -1 when empty
+    int start[2];     //start state in the middle and at the start of a line, -1 until built
+    int *work;        //NFA states reached by a step
+    int nwork;
+    unsigned int *mark;  //the step that last reached each NFA state
+    unsigned int gen;
+};
+
+//what one thread needs to search with a regex: the backwards DFA marks where matches
+//start, the forwards one finds how far the longest of them goes
+struct regex_match {
+    struct regex *re;
+    struct regex_dfa fwd, rev;
+    unsigned char *starts;
+    int cap;
+};
+
+//every match of the query being searched for, in file order
+struct find_match {
+    int row;
+    int rx;   //offset in the render
+    int len;  //length in the render
+};
+
+struct match_set {
+    struct find_match *m;
+    int n;
+    int cap;
+    bool more;    //there were more than MATCH_SET_MAX matches, the rest aren't collected
+    bool counting;  //the search threads are still adding matches
+    char *query;  //what the matches are for, NULL when not searching
+    int len;
+    int current;  //the match the cursor is on, -1 if none
+    bool regex;   //the query is a regular expression
+    struct regex *re;         //the compiled query, NULL if it doesn't compile
+    struct regex_match *rm;   //matcher for the main thread
+};
+
+//the rows cut into pieces a thread can read without touching the row store, for searching
+//and saving: runs of lines that are still only in the mapped file, and loaded rows
+struct row_piece {
+    int row;      //row number of the piece's first line
+    int line;     //first mapped line of a run
+    int count;    //lines in a run, 0 for a loaded row
+    char *chars;  //text of a loaded row
+    int size;
+};
+
+//consecutive pieces searched by one thread, their matches are merged in order
+struct search_chunk {
+    int first, last;  //pieces [first, last)
+    struct find_match *m;
+    int n;
+    int cap;
+    bool full;  //stopped at MATCH_SET_MAX matches
+    bool done;
+};
+
+struct search_pool {
+    pthread_t *threads;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;   //a job was started
+    pthread_cond_t done;   //a chunk was finished
+    int gen;               //bumped to start or cancel a job, threads give up on older ones
+    bool running;
+    char *query;
+    int len;
+    struct regex *re;  //the query compiled, when it's a regex
+    struct row_piece *pieces;
+    int npieces;
+    int pieces_cap;
+    struct search_chunk *chunks;
+    int nchunks;
+    int chunks_cap;
+    int next;    //next chunk to hand out
+    int merged;  //chunks already added to the match set
+    int busy;    //threads in the middle of a chunk
+};
+
+//a save running on a thread of its own. it writes out a snapshot of the rows, made of pieces
+//that point at the mapping and at the text of the loaded rows. while it runs, that text is
+//copied before being edited, and the text that was replaced is only freed when it's done
+struct save_job {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    bool running;        //a save was started and not finished yet
+    bool threaded;       //it runs on the thread rather than having been done in place
+    bool done;           //guarded by lock
+    unsigned int gen;    //rows whose frozen is this are being written out
+    char *path;
+    char *tmp;           //guarded by lock, the file being written until it's moved over path
+    int fd;              //open on tmp
+    struct row_piece *pieces;
+    int npieces;
+    int cap;
+    size_t total;        //bytes to write, about
+    size_t written;      //guarded by lock
+    ssize_t result;      //bytes written, or -1
+    int err;
+    int dirty;           //E.dirty when the snapshot was taken
+    char **retired;      //text of frozen rows that was replaced or deleted
+    int nretired;
+    int retired_cap;
+};
+
+//keyboard input, read a burst at a time and decoded into keys from here
+struct input_buf {
+    char buf[INPUT_BUF_SIZE];
+    int len;
+    int pos;  //next byte to decode
+};
+
+enum perf_phase {
+    PERF_WAIT,       //waiting for keys and idle work, not shown
+    PERF_DECODE,
+    PERF_EDIT,
+    PERF_HIGHLIGHT,
+    PERF_DRAW,
+    PERF_PHASES
+};
+
+//how many values fell in each power of two: bucket 0 holds those below 1, bucket b those
+//from 2^(b-1) up to 2^b
+struct perf_hist {
+    unsigned long n[PERF_BUCKETS];
+    unsigned long count;
+};
+
+//where the time goes between two frames, split into phases. time is charged to the phase
+//innermost on the stack, so the highlighting done while drawing isn't counted twice
+struct perf_stats {
+    bool on;
+    int stack[PERF_DEPTH];
+    int top;
+    struct timespec since;  //when the time was last charged
+    double acc[PERF_PHASES];   //us in each phase since the last frame
+    double last[PERF_PHASES];  //us in each phase for the last frame
+    struct perf_hist hist[PERF_PHASES];
+    int last_bytes;
+    unsigned long last_allocs;
+    unsigned long allocs;      //alloc_count at the last frame
+    struct perf_hist bytes;
+    struct perf_hist nallocs;
+};
+
 struct editor_config {
     int cx, cy;   //cursor position in the chars field, starting at 0
     int rx;       //cursor position in the render field, starting at 0
@@ -85,8 +444,30 @@ struct editor_config {
     int screencols;
     int numrows;
     int row_num_offset;
-    erow *row;
+    row_node *rows;
+    struct file_map map;
+    erow **rendered;  //rows currently holding render and hl
+    int nrendered;
+    int rendered_cap;
+    unsigned int frame;
+    erow **stale;  //rows left to rehighlight because they were below the screen
+    int nstale;
+    int stale_cap;
+    struct screen screen;
+    struct hl_worker hl_worker;
+    struct match_set matches;
+    struct search_pool search;
+    struct save_job save;
+    struct input_buf input;
+    struct perf_stats perf;
+    bool headless;       //no terminal: keys come from the bench script or a replay, frames aren't written out
+    bool recording;      //keys read are logged for replaying
+    volatile sig_atomic_t resized;  //set by the SIGWINCH handler
+    bool sync_output;    //the terminal supports synchronized output
+    int frame_bytes;     //bytes written by the last refresh
+    long bytes_written;  //bytes written by all refreshes so far
     int dirty;
+    int edit_from;       //first row edited since the rows were read from the file, INT_MAX if none
     int quit_times;
     char *filename;
     char statusmsg[80];
@@ -117,18 +498,342 @@ struct editor_syntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL, 0, 0, 0
     },
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 /*** prototypes ***/
 
+void die(const char *s);
 void editor_set_status_message(const char *fmt, ...);
 void editor_move_cursor(int key);
 void editor_refresh_screen();
+void editor_update_row(erow *row);
+void editor_update_row_offset();
+void editor_map_index_idle();
+void editor_syntax_idle();
+void editor_matches_idle();
+void editor_save_idle();
+void editor_save_finish(bool wait);
+void editor_save_abandon();
+void editor_bench_key_done();
+void editor_bench_key_start(int key);
+bool editor_bench_feed(struct input_buf *in, int timeout);
+bool editor_bench_pending(int timeout);
+bool editor_bench_idles();
+void editor_record_keys(char *keys, int len);
+void editor_record_resize(int rows, int cols);
+void editor_resize(int rows, int cols);
+bool editor_row_frozen(erow *row);
+void editor_save_retire(char *chars);
+void editor_search_cancel();
+void init_separators();
+void editor_hl_worker_start();
+void editor_hl_worker_stop();
+int editor_span_state(row_node *span, int off);
+bool editor_hl_worker_busy();
+void screen_init(int rows, int cols);
+int editor_row_expand(erow *row, char **buf, int *cap);
+void editor_row_drop_render(erow *row);
 char *editor_prompt(char *prompt, void (*callback)(char *, int));
 
+/*** perf ***/
+
+//built with -DKILO_COUNT_ALLOCS ("make bench" and "make kilo-trace") every allocation is counted, for the
+//bench and the perf overlay to report. glibc lets a program supply its own malloc, these only keep count and
+//hand the work on to glibc's. free isn't counted, so it stays glibc's own. other builds report no allocations
+#if defined(KILO_COUNT_ALLOCS) && defined(__GLIBC__)
+#define ALLOCS_COUNTED 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+unsigned long alloc_count;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, size);
+}
+#else
+#define ALLOCS_COUNTED 0
+unsigned long alloc_count;
+#endif
+
+void perf_hist_add(struct perf_hist *h, double v)
+{
+    unsigned long x = v;
+    int b = 0;
+    while(x && b < PERF_BUCKETS - 1) {
+        x >>= 1;
+        b++;
+    }
+    h->n[b]++;
+    h->count++;
+}
+
+//the top of the bucket the 99th percentile falls in
+unsigned long perf_hist_p99(struct perf_hist *h)
+{
+    unsigned long want = h->count - h->count / 100, seen = 0;
+    for(int b = 0; b < PERF_BUCKETS; b++) {
+        seen += h->n[b];
+        if(seen && seen >= want) return 1UL << b;
+    }
+    return 0;
+}
+
+//charge the time since the last change to the phase on top of the stack
+void perf_charge()
+{
+    struct perf_stats *p = &E.perf;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    p->acc[p->stack[p->top]] += (now.tv_sec - p->since.tv_sec) * 1e6 + (now.tv_nsec - p->since.tv_nsec) / 1e3;
+    p->since = now;
+}
+
+void perf_push(int phase)
+{
+    struct perf_stats *p = &E.perf;
+    if(!p->on || p->top == PERF_DEPTH - 1) return;
+    perf_charge();
+    p->stack[++p->top] = phase;
+}
+
+//a pop without its push, when the stats were switched on in between, is ignored
+void perf_pop()
+{
+    struct perf_stats *p = &E.perf;
+    if(!p->on || p->top == 0) return;
+    perf_charge();
+    p->top--;
+}
+
+//the work for a frame is done, it's what the overlay shows next
+void perf_frame()
+{
+    struct perf_stats *p = &E.perf;
+    if(!p->on) return;
+    perf_charge();
+    for(int i = PERF_DECODE; i < PERF_PHASES; i++) {
+        p->last[i] = p->acc[i];
+        perf_hist_add(&p->hist[i], p->acc[i]);
+        p->acc[i] = 0;
+    }
+    p->last_bytes = E.frame_bytes;
+    perf_hist_add(&p->bytes, E.frame_bytes);
+    p->last_allocs = alloc_count - p->allocs;
+    p->allocs = alloc_count;
+    perf_hist_add(&p->nallocs, p->last_allocs);
+}
+
+void perf_switch(bool on)
+{
+    struct perf_stats *p = &E.perf;
+    p->on = on;
+    p->top = 0;
+    p->stack[0] = PERF_WAIT;
+    clock_gettime(CLOCK_MONOTONIC, &p->since);
+    p->allocs = alloc_count;
+}
+
+//last and p99 of each phase in us, then what the last frame wrote and allocated
+int perf_overlay(char *buf, int size)
+{
+    struct perf_stats *p = &E.perf;
+    static const char *names[PERF_PHASES] = {"", "in", "ed", "hl", "dr"};
+    int len = 0;
+    for(int i = PERF_DECODE; i < PERF_PHASES && len < size; i++)
+        len += snprintf(buf + len, size - len, "%s %.0f/%lu ", names[i], p->last[i], perf_hist_p99(&p->hist[i]));
+    if(len < size)
+        len += snprintf(buf + len, size - len, "us %dB", p->last_bytes);
+    if(ALLOCS_COUNTED && len < size)
+        len += snprintf(buf + len, size - len, " %lua", p->last_allocs);
+    return len < size ? len : size - 1;
+}
+
+void perf_dump_hist(FILE *fp, const char *name, struct perf_hist *h, const char *unit)
+{
+    fprintf(fp, "%-12s", name);
+    for(int b = 0; b < PERF_BUCKETS; b++)
+        if(h->n[b]) fprintf(fp, " <%lu%s:%lu", 1UL << b, unit, h->n[b]);
+    fprintf(fp, "\n");
+}
+
+//add the histograms of this run to PERF_FILE, headed by the build and the file, so runs of
+//different builds on the same work can be set side by side
+void perf_dump()
+{
+    struct perf_stats *p = &E.perf;
+    static const char *names[PERF_PHASES] = {"", "decode", "edit", "highlight", "draw"};
+    if(p->hist[PERF_DRAW].count == 0) return;
+    FILE *fp = fopen(PERF_FILE, "a");
+    if(fp == NULL) return;
+    char when[32];
+    time_t now = time(NULL);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(fp, "# %s kilo %s built %s %s, %s, %lu frames\n", when, KILO_VERSION, __DATE__, __TIME__,
+            E.filename ? E.filename : "[No name]", p->hist[PERF_DRAW].count);
+    for(int i = PERF_DECODE; i < PERF_PHASES; i++)
+        perf_dump_hist(fp, names[i], &p->hist[i], "us");
+    perf_dump_hist(fp, "bytes", &p->bytes, "B");
+    if(ALLOCS_COUNTED) perf_dump_hist(fp, "allocs", &p->nallocs, "");
+    fclose(fp);
+}
+
+/*** trace ***/
+
+//scoped trace points for the hot paths, built in with -DKILO_TRACING ("make kilo-trace") and
+//switched on by setting KILO_TRACE to a path. each thread records into a ring of its own,
+//with nothing to lock, and on exit they are written out as a Chrome trace for chrome://tracing
+//or Perfetto. a scope is closed by the cleanup attribute, whichever way the function returns
+#ifdef KILO_TRACING
+
+struct trace_event {
+    const char *name;
+    double ts, dur;  //us since tracing started
+    long arg;        //-1 if none
+};
+
+struct trace_ring {
+    struct trace_ring *next;
+    const char *name;
+    int tid;
+    unsigned long head;  //events recorded so far, published with release
+    unsigned long size;
+    struct trace_event ev[];
+};
+
+struct trace_scope {
+    const char *name;
+    double start;
+    long arg;
+};
+
+struct trace {
+    bool on;
+    char *path;
+    struct timespec t0;
+    struct trace_ring *rings;  //every thread's ring, pushed with compare and swap
+    int tids;
+    unsigned long size;        //events in the main thread's ring, KILO_TRACE_EVENTS or TRACE_RING
+};
+
+struct trace trace;
+__thread struct trace_ring *trace_ring;
+
+double trace_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - trace.t0.tv_sec) * 1e6 + (now.tv_nsec - trace.t0.tv_nsec) / 1e3;
+}
+
+struct trace_ring *trace_thread(const char *name)
+{
+    if(!trace.on) return NULL;
+    if(trace_ring == NULL) {
+        //the main thread's ring is made first, by trace_init
+        int tid = __atomic_add_fetch(&trace.tids, 1, __ATOMIC_RELAXED);
+        unsigned long size = tid == 1 ? trace.size : trace.size / (TRACE_RING / TRACE_WORKER_RING);
+        if(size == 0) size = 1;
+        struct trace_ring *r = calloc(1, sizeof(struct trace_ring) + size * sizeof(struct trace_event));
+        if(r == NULL) die("calloc");
+        r->tid = tid;
+        r->size = size;
+        r->next = __atomic_load_n(&trace.rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&trace.rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        trace_ring = r;
+    }
+    if(name) trace_ring->name = name;
+    return trace_ring;
+}
+
+struct trace_scope trace_begin(const char *name, long arg)
+{
+    struct trace_scope sc = {name, trace.on ? trace_now() : 0, arg};
+    return sc;
+}
+
+void trace_end(struct trace_scope *sc)
+{
+    if(!trace.on) return;
+    struct trace_ring *r = trace_thread(NULL);
+    struct trace_event *ev = &r->ev[r->head % r->size];
+    ev->name = sc->name;
+    ev->ts = sc->start;
+    ev->dur = trace_now() - sc->start;
+    ev->arg = sc->arg;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+//write every ring out as complete ("X") events, threads named by metadata events
+void trace_dump()
+{
+    FILE *fp = fopen(trace.path, "w");
+    if(fp == NULL) return;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = 1;
+    for(struct trace_ring *r = __atomic_load_n(&trace.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", r->tid, r->name ? r->name : "thread");
+        first = 0;
+        unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned long from = head > r->size ? head - r->size : 0;
+        for(unsigned long i = from; i < head; i++) {
+            struct trace_event *ev = &r->ev[i % r->size];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    ev->name, r->tid, ev->ts, ev->dur);
+            if(ev->arg >= 0) fprintf(fp, ",\"args\":{\"n\":%ld}", ev->arg);
+            fprintf(fp, "}");
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+void trace_init()
+{
+    trace.path = getenv("KILO_TRACE");
+    if(trace.path == NULL || !*trace.path) return;
+    clock_gettime(CLOCK_MONOTONIC, &trace.t0);
+    char *size = getenv("KILO_TRACE_EVENTS");
+    trace.size = size && atol(size) > 0 ? (unsigned long)atol(size) : TRACE_RING;
+    trace.on = 1;
+    trace_thread("main");
+    atexit(trace_dump);
+}
+
+#define TRACE_SCOPE_ARG(name, arg) \
+    struct trace_scope trace_scope __attribute__((cleanup(trace_end))) = trace_begin(name, trace.on ? (long)(arg) : -1)
+#define TRACE_THREAD(name) trace_thread(name)
+#define TRACE_INIT() trace_init()
+
+#else
+
+#define TRACE_SCOPE_ARG(name, arg) ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+#define TRACE_INIT() ((void)0)
+
+#endif
+
+#define TRACE_SCOPE(name) TRACE_SCOPE_ARG(name, -1)
+
 /*** terminal ***/
 
 void die(const char *s) {
@@ -143,10 +848,17 @@ void die(const char *s) {
 
 void disable_raw_mode()
 {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_terminos) == -1)
         die("tcsetattr");
 }
 
+void handle_winch(int sig)
+{
+    (void)sig;
+    E.resized = 1;
+}
+
 void enable_raw_mode()
 {
     if(tcgetattr(STDIN_FILENO, &E.orig_terminos) == -1) die("tcgetattr");
@@ -182,58 +894,197 @@ void enable_raw_mode()
     raw.c_cc[VTIME] = 1;
 
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) ==-1) die("tcsetattr");
+
+    //bracketed paste: the terminal wraps pasted text in ESC[200~ and ESC[201~, so it can be
+    //inserted in one go rather than typed in a key at a time
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+
+    //no SA_RESTART, a resize breaks the wait for a key
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_winch;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
 }
 
-int editor_read_key() 
+//whether input is waiting, already read or still at the terminal, giving it up to timeout ms
+//to arrive. the idle work asks this between steps so that a key is never kept waiting
+bool editor_input_pending(int timeout)
 {
-    int nread;
-    char c;
-    while((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if(nread == -1 && errno != EAGAIN) die("read");
-    }
-
-    if(c == '\x1b') {
-        char seq[3];
-
-        //if read() times out, will return <esc>
-        if(read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if(read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-        if(seq[0] == '[') {
-            if(seq[1] >= '0' && seq[1] <= '9') {
-                if(read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if(seq[2] == '~') {
-                    switch(seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
-            } else {
-                switch(seq[1]) {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY;
-                    case 'F': return END_KEY;
-                }
-            }
-        } else if(seq[0] == '0') {
-            switch(seq[1]) {
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
-            }
+    if(E.input.pos < E.input.len || E.resized) return 1;
+    if(E.headless) return editor_bench_pending(timeout);
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, timeout) > 0;
+}
+
+//read as much as the terminal has into the buffer, after waiting up to timeout ms for it
+//(-1 for as long as it takes). a paste or a held key comes in with one read. returns 0 if
+//nothing came
+bool editor_input_fill(int timeout)
+{
+    struct input_buf *in = &E.input;
+    if(in->pos > 0) {
+        memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+        in->len -= in->pos;
+        in->pos = 0;
+    }
+    if(in->len == INPUT_BUF_SIZE) return 1;
+    if(E.headless) return editor_bench_feed(in, timeout);
+
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    int ready = poll(&pfd, 1, timeout);
+    if(ready == -1 && errno != EINTR) die("poll");
+    if(ready <= 0) return 0;
+
+    ssize_t n = read(STDIN_FILENO, in->buf + in->len, INPUT_BUF_SIZE - in->len);
+    if(n == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if(n <= 0) return 0;
+    if(E.recording) editor_record_keys(in->buf + in->len, n);
+    in->len += n;
+    return 1;
+}
+
+//the next byte of input, waiting up to timeout ms for it. -1 if none came
+int editor_input_byte(int timeout)
+{
+    struct input_buf *in = &E.input;
+    if(in->pos == in->len && !editor_input_fill(timeout)) return -1;
+    return (unsigned char)in->buf[in->pos++];
+}
+
+//decode the key the input starts with. an escape sequence is read up to its final byte, the
+//parameters before it aren't needed except for the first one, which tells the keys ending in
+//'~' apart. a sequence that isn't a key is swallowed whole and gives -1, rather than leaving
+//its tail to be typed into the text. an ESC with nothing after it is the key itself
+int editor_decode_key()
+{
+    int c = editor_input_byte(-1);
+    if(c == -1) return -1;  //the wait was broken by a resize
+    if(c != '\x1b') return c;
+
+    int intro = editor_input_byte(INPUT_ESC_WAIT);
+    if(intro == -1) return '\x1b';
+    if(intro == 'O') {
+        switch(editor_input_byte(INPUT_ESC_WAIT)) {
+            case 'A': return ARROW_UP;
+            case 'B': return ARROW_DOWN;
+            case 'C': return ARROW_RIGHT;
+            case 'D': return ARROW_LEFT;
+            case 'H': return HOME_KEY;
+            case 'F': return END_KEY;
         }
+        return -1;
+    }
+    if(intro != '[') return '\x1b';
 
-        return '\x1b';
-    } else {
-        return c;
+    //parameter and intermediate bytes run until a final byte in 0x40-0x7e
+    int param = 0;
+    bool first = 1;
+    while(1) {
+        c = editor_input_byte(INPUT_ESC_WAIT);
+        if(c == -1) return -1;
+        if(c >= 0x40 && c <= 0x7e) break;
+        if(c == ';') first = 0;
+        else if(first && isdigit(c) && param < 10000) param = param * 10 + c - '0';
+    }
+
+    switch(c) {
+        case 'A': return ARROW_UP;
+        case 'B': return ARROW_DOWN;
+        case 'C': return ARROW_RIGHT;
+        case 'D': return ARROW_LEFT;
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+        case '~':
+            switch(param) {
+                case 200: return PASTE_KEY;
+                case 1: return HOME_KEY;
+                case 3: return DEL_KEY;
+                case 4: return END_KEY;
+                case 5: return PAGE_UP;
+                case 6: return PAGE_DOWN;
+                case 7: return HOME_KEY;
+                case 8: return END_KEY;
+            }
+    }
+    return -1;
+}
+
+//read the text of a bracketed paste, up to the ESC[201~ that closes it. the text is copied
+//out of the input buffer a run at a time, only an ESC in it is looked at more closely.
+//returns a malloc'ed buffer, *len is set to the length of the text
+char *editor_read_paste(size_t *len)
+{
+    static const char end[] = "\x1b[201~";
+    const int endlen = sizeof(end) - 1;
+    struct input_buf *in = &E.input;
+    size_t n = 0, cap = INPUT_BUF_SIZE;
+    char *text = malloc(cap);
+    if(text == NULL) die("malloc");
+
+    while(in->pos < in->len || editor_input_fill(INPUT_PASTE_WAIT)) {
+        char *p = in->buf + in->pos;
+        char *esc = memchr(p, '\x1b', in->len - in->pos);
+        size_t run = esc ? esc - p : in->len - in->pos;
+        if(n + run + 1 > cap) {
+            while(n + run + 1 > cap) cap *= 2;
+            text = realloc(text, cap);
+            if(text == NULL) die("realloc");
+        }
+        memcpy(text + n, p, run);
+        n += run;
+        in->pos += run;
+        if(esc == NULL) continue;
+
+        while(in->len - in->pos < endlen && editor_input_fill(INPUT_ESC_WAIT));
+        if(in->len - in->pos >= endlen && !memcmp(in->buf + in->pos, end, endlen)) {
+            in->pos += endlen;
+            break;
+        }
+        text[n++] = in->buf[in->pos++];  //an ESC that is part of the text
     }
+    *len = n;
+    return text;
+}
+
+//the terminal changed size, the screen is drawn again to fit
+void editor_handle_resize()
+{
+    struct winsize ws;
+    E.resized = 0;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) return;
+    if(E.recording) editor_record_resize(ws.ws_row, ws.ws_col);
+    editor_resize(ws.ws_row, ws.ws_col);
+    editor_refresh_screen();
+}
+
+int editor_read_key() 
+{
+    int key;
+    if(E.headless) editor_bench_key_done();
+    perf_push(PERF_WAIT);
+    do {
+        if(E.resized) editor_handle_resize();
+        //the idle work only runs when nothing is left to decode, a burst of keys is
+        //applied straight through. a bench or a fast replay runs it in steps of its own
+        if(!editor_input_pending(0) && editor_bench_idles()) {
+            editor_map_index_idle();
+            editor_syntax_idle();
+            editor_matches_idle();
+            editor_save_idle();
+        }
+        //decoding is timed from when the key has started to come in
+        if(E.input.pos == E.input.len && !editor_input_fill(-1)) {
+            key = -1;
+            continue;
+        }
+        perf_push(PERF_DECODE);
+        key = editor_decode_key();
+        perf_pop();
+    } while(key == -1);
+    perf_pop();
+    if(E.headless) editor_bench_key_start(key);
+    return key;
 }
 
 int get_cursor_position(int *rows, int *cols)
@@ -256,6 +1107,29 @@ int get_cursor_position(int *rows, int *cols)
     return 0;
 }
 
+//ask whether the terminal knows synchronized output (mode 2026). The query is followed by a
+//device attributes request, which every terminal answers, so a terminal that ignores the
+//first question doesn't leave us waiting
+int detect_sync_output()
+{
+    char buf[128];
+    unsigned int i = 0;
+    if(write(STDOUT_FILENO, "\x1b[?2026$p\x1b[c", 12) != 12) return 0;
+
+    while(i < sizeof(buf) - 1) {
+        if(read(STDIN_FILENO, &buf[i], 1) != 1) break;
+        //the device attributes reply ends with 'c', and it always comes last
+        if(buf[i++] == 'c') break;
+    }
+    buf[i] = '\0';
+
+    //the mode report is ESC [ ? 2026 ; Ps $ y, with Ps 1, 2 or 3 when the mode is known
+    char *report = strstr(buf, "\x1b[?2026;");
+    if(report == NULL) return 0;
+    char ps = report[strlen("\x1b[?2026;")];
+    return ps == '1' || ps == '2' || ps == '3';
+}
+
 int get_window_size(int *rows, int *cols)
 {
     struct winsize ws;
@@ -303,6 +1177,11 @@ void read_config_file() {
             if(*p == '1') {
                 E.options |= ENABLE_AUTO_INDENT;
             }
+        } else if(strstr(line, "FrameStats") != NULL) {
+            p = line + strlen("FrameStats") + 1;
+            if(*p == '1') {
+                E.options |= ENABLE_FRAME_STATS;
+            }
         } else if(strstr(line, "TabStop") != NULL) {
             p = line + strlen("TabStop") + 1;
             E.KILO_TAB_STOP = get_int(p);
@@ -315,97 +1194,579 @@ void read_config_file() {
 
 void init_editor() 
 {
+    atexit(editor_save_abandon);
     E.cx = 0;
     E.cy = 0;
     E.rx = 0;
     E.rowoff = 0;  //scroll to the top of the file by default
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rows = NULL;
+    memset(&E.map, 0, sizeof(E.map));
+    E.rendered = NULL;
+    E.nrendered = 0;
+    E.rendered_cap = 0;
+    E.frame = 0;
+    E.sync_output = E.headless ? 0 : detect_sync_output();
+    E.frame_bytes = 0;
+    E.bytes_written = 0;
     E.dirty = 0;
+    E.edit_from = INT_MAX;
     E.filename =  NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
+    init_separators();
     E.row_num_offset = 0;
     E.options = 0;
-    if(get_window_size(&E.screenrows, &E.screencols) == -1) die("get_window_size");
+    //without a terminal, the screen size was set by whoever asked for that
+    if(!E.headless && get_window_size(&E.screenrows, &E.screencols) == -1) die("get_window_size");
+    screen_init(E.screenrows, E.screencols);
     E.screenrows -= 2;
     E.KILO_QUIT_TIMES = 3;
     E.KILO_TAB_STOP = 8;
     read_config_file();
+    perf_switch(E.options & ENABLE_FRAME_STATS);
     E.quit_times = E.KILO_QUIT_TIMES;
 }
 
-/*** sytax highlighting ***/
+/*** row store ***/
 
-int is_separator(int c) 
+unsigned int row_node_rand()
 {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+    //xorshift, the priorities only need to be uncorrelated with the positions
+    static unsigned int seed = 2463534242u;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
 }
 
-void editor_update_syntax(erow *row)
+row_node *row_node_new(int span, int line)
 {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+    row_node *node = calloc(1, sizeof(row_node));
+    if(node == NULL) die("calloc");
+    node->priority = row_node_rand();
+    node->span = span;
+    node->line = line;
+    node->count = span ? span : 1;
+    return node;
+}
 
-    if(E.syntax == NULL) return;
+int row_node_count(row_node *n)
+{
+    return n ? n->count : 0;
+}
 
-    char **keywords = E.syntax->keywords;
+int row_node_lines(row_node *n)
+{
+    return n->span ? n->span : 1;
+}
 
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+void row_node_update(row_node *n)
+{
+    n->count = row_node_lines(n) + row_node_count(n->left) + row_node_count(n->right);
+    if(n->left) n->left->parent = n;
+    if(n->right) n->right->parent = n;
+}
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
-    
-    bool prev_sep = 1;
-    bool in_string = 0;
-    bool in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+row_node *row_node_merge(row_node *a, row_node *b);
 
-    int i = 0;
-    while(i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+//split t into the first k rows (*l) and the rest (*r), cutting a span in two if needed
+void row_node_split(row_node *t, int k, row_node **l, row_node **r)
+{
+    if(t == NULL) {
+        *l = *r = NULL;
+        return;
+    }
+    int lcount = row_node_count(t->left);
+    if(k <= lcount) {
+        row_node_split(t->left, k, l, &t->left);
+        *r = t;
+    } else if(k >= lcount + row_node_lines(t)) {
+        row_node_split(t->right, k - lcount - row_node_lines(t), &t->right, r);
+        *l = t;
+    } else {
+        int head = k - lcount;
+        row_node *tail = row_node_new(t->span - head, t->line + head);
+        t->span = head;
+        *r = row_node_merge(tail, t->right);
+        t->right = NULL;
+        *l = t;
+    }
+    row_node_update(t);
+}
 
-        //check for singleline comment
-        //when in multiline comment, singleline comment shouldn't be recognized
-        if(scs_len && !in_string && !in_comment) {
-            if(!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
-        }
+//concatenate a and b, every row of a goes before every row of b
+row_node *row_node_merge(row_node *a, row_node *b)
+{
+    if(a == NULL) return b;
+    if(b == NULL) return a;
+    if(a->priority > b->priority) {
+        a->right = row_node_merge(a->right, b);
+        row_node_update(a);
+        return a;
+    } else {
+        b->left = row_node_merge(a, b->left);
+        row_node_update(b);
+        return b;
+    }
+}
 
-        //check for multiline comment
-        if(mcs_len && mce_len && !in_string) {
-            if(in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if(!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if(!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
+void row_node_free(row_node *n)
+{
+    if(n == NULL) return;
+    row_node_free(n->left);
+    row_node_free(n->right);
+    if(!n->span) {
+        if(!n->row.mapped) free(n->row.chars);
+        free(n->row.render);
+        free(n->row.hl);
+        if(n->row.index) free(n->row.index->m);
+        free(n->row.index);
+    }
+    free(n);
+}
+
+//the node holding row at, *off is set to the position of the row inside a span
+row_node *row_node_at(int at, int *off)
+{
+    row_node *n = E.rows;
+    while(n) {
+        int lcount = row_node_count(n->left);
+        if(at < lcount) {
+            n = n->left;
+        } else if(at < lcount + row_node_lines(n)) {
+            *off = at - lcount;
+            return n;
+        } else {
+            at -= lcount + row_node_lines(n);
+            n = n->right;
         }
-        //check for strings
-        if(E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+    }
+    return NULL;
+}
+
+int row_node_index(row_node *n)
+{
+    int idx = row_node_count(n->left);
+    for(; n->parent; n = n->parent) {
+        if(n == n->parent->right)
+            idx += row_node_count(n->parent->left) + row_node_lines(n->parent);
+    }
+    return idx;
+}
+
+row_node *row_node_next(row_node *n)
+{
+    if(n->right) {
+        for(n = n->right; n->left; n = n->left);
+        return n;
+    }
+    while(n->parent && n == n->parent->right) n = n->parent;
+    return n->parent;
+}
+
+row_node *row_node_prev(row_node *n)
+{
+    if(n->left) {
+        for(n = n->left; n->right; n = n->right);
+        return n;
+    }
+    while(n->parent && n == n->parent->left) n = n->parent;
+    return n->parent;
+}
+
+row_node *row_node_first()
+{
+    row_node *n = E.rows;
+    while(n && n->left) n = n->left;
+    return n;
+}
+
+void editor_rows_set_root(row_node *root)
+{
+    E.rows = root;
+    if(root) root->parent = NULL;
+    E.numrows = row_node_count(root);
+}
+
+//where line of the mapped file starts, and its length without the line break
+char *editor_map_line(int line, int *len)
+{
+    size_t start = line ? E.map.eol[line - 1] + 1 : 0;
+    size_t end = E.map.eol[line];
+    while(end > start && (E.map.data[end - 1] == '\n' || E.map.data[end - 1] == '\r'))
+        end--;
+    *len = end - start;
+    return E.map.data + start;
+}
+
+//turn mapped row at into a real row, its text stays in the mapping until it's edited
+erow *editor_rows_load(int at)
+{
+    row_node *l, *m, *r;
+    row_node_split(E.rows, at, &l, &r);
+    row_node_split(r, 1, &m, &r);
+    m->row.chars = editor_map_line(m->line, &m->row.size);
+    m->row.mapped = 1;
+    m->span = 0;
+    editor_rows_set_root(row_node_merge(row_node_merge(l, m), r));
+    editor_update_row(&m->row);
+    return &m->row;
+}
+
+erow *editor_row_at(int at)
+{
+    int off;
+    row_node *n = row_node_at(at, &off);
+    if(n == NULL) return NULL;
+    if(!n->span) return &n->row;
+
+    //the comment state flows down from the row above. the background pass usually knows it,
+    //otherwise the rows above are loaded first. far from them the row is loaded on its own
+    //and redone once the background pass gets there
+    if(E.syntax) {
+        int state = editor_span_state(n, off);
+        if(state == -1 || (state == -2 && off < SYNTAX_LOAD_AHEAD)) {
+            for(int j = at - off; j < at; j++)
+                editor_rows_load(j);
+        }
+    }
+    return editor_rows_load(at);
+}
+
+int editor_row_index(erow *row)
+{
+    return row_node_index(ROW_NODE(row));
+}
+
+erow *editor_row_next(erow *row)
+{
+    row_node *n = row_node_next(ROW_NODE(row));
+    if(n == NULL) return NULL;
+    return n->span ? editor_row_at(editor_row_index(row) + 1) : &n->row;
+}
+
+erow *editor_row_prev(erow *row)
+{
+    row_node *n = row_node_prev(ROW_NODE(row));
+    if(n == NULL) return NULL;
+    return n->span ? editor_row_at(editor_row_index(row) - 1) : &n->row;
+}
+
+//link a fresh node so that it becomes row number at
+erow *editor_rows_insert(int at)
+{
+    row_node *node = row_node_new(0, 0);
+    row_node *l, *r;
+    row_node_split(E.rows, at, &l, &r);
+    editor_rows_set_root(row_node_merge(row_node_merge(l, node), r));
+    return &node->row;
+}
+
+//unlink row number at, the caller owns the returned row until editor_rows_release
+erow *editor_rows_remove(int at)
+{
+    erow *row = editor_row_at(at);
+    if(row == NULL) return NULL;
+    row_node *l, *m, *r;
+    row_node_split(E.rows, at, &l, &r);
+    row_node_split(r, 1, &m, &r);
+    editor_rows_set_root(row_node_merge(l, r));
+    return row;
+}
+
+void editor_rows_release(erow *row)
+{
+    free(ROW_NODE(row));
+}
+
+void editor_rows_free_all()
+{
+    while(E.nrendered)
+        editor_row_drop_render(E.rendered[E.nrendered - 1]);
+    row_node_free(E.rows);
+    editor_rows_set_root(NULL);
+    E.nstale = 0;
+}
+
+/*** file map ***/
+
+int editor_map_pending()
+{
+    return E.map.data && E.map.scanned < E.map.len;
+}
+
+void editor_map_push_line(size_t eol)
+{
+    if(E.map.nlines == E.map.cap) {
+        E.map.cap = E.map.cap ? E.map.cap * 2 : 1024;
+        E.map.eol = realloc(E.map.eol, sizeof(size_t) * E.map.cap);
+        if(E.map.eol == NULL) die("realloc");
+    }
+    E.map.eol[E.map.nlines++] = eol;
+}
+
+//search the next budget bytes for line breaks, the lines found are appended as one span
+void editor_map_index(size_t budget)
+{
+    if(!editor_map_pending()) return;
+
+    int first = E.map.nlines;
+    char *p = E.map.data + E.map.scanned;
+    char *stop = p + (E.map.len - E.map.scanned < budget ? E.map.len - E.map.scanned : budget);
+    char *nl;
+    //memchr is vectorized by the libc, so this runs at memory bandwidth
+    while(p < stop && (nl = memchr(p, '\n', stop - p)) != NULL) {
+        if(nl > E.map.data && nl[-1] == '\r') E.map.cr = 1;
+        editor_map_push_line(nl - E.map.data);
+        p = nl + 1;
+    }
+    E.map.scanned = stop - E.map.data;
+
+    //the last line might not end with a newline
+    size_t line_start = E.map.nlines ? E.map.eol[E.map.nlines - 1] + 1 : 0;
+    if(E.map.scanned == E.map.len && line_start < E.map.len) {
+        if(E.map.data[E.map.len - 1] == '\r') E.map.cr = 1;
+        editor_map_push_line(E.map.len);
+    }
+
+    if(E.map.nlines > first) {
+        row_node *span = row_node_new(E.map.nlines - first, first);
+        editor_rows_set_root(row_node_merge(E.rows, span));
+        if(E.options & ENABLE_LINE_NUM) {
+            editor_update_row_offset();
+        }
+    }
+}
+
+void editor_map_index_all()
+{
+    while(editor_map_pending())
+        editor_map_index(MAP_INDEX_SLICE);
+}
+
+//keep indexing while no key is waiting, redrawing now and then so the line count moves
+void editor_map_index_idle()
+{
+    struct timespec last, now;
+    bool drawn = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    while(editor_map_pending() && !editor_input_pending(0)) {
+        editor_map_index(MAP_INDEX_SLICE);
+        drawn = 0;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if((now.tv_sec - last.tv_sec) * 1000 + (now.tv_nsec - last.tv_nsec) / 1000000 >= 100) {
+            editor_refresh_screen();
+            drawn = 1;
+            last = now;
+        }
+    }
+    if(!drawn) editor_refresh_screen();
+}
+
+//map a regular file read-only, NULL if it can't be mapped or is empty. *st describes the file
+char *editor_map_file(char *filename, struct stat *st)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) return NULL;
+
+    if(fstat(fd, st) == -1 || !S_ISREG(st->st_mode) || st->st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    char *data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  //the mapping keeps the file alive
+    if(data == MAP_FAILED) return NULL;
+    return data;
+}
+
+//take data as the text of the file and index just its first slice, the rest is indexed while idle.
+//heap says whether data was malloc'ed or mapped
+void editor_map_set(char *data, size_t len, bool heap)
+{
+    E.map.data = data;
+    E.map.len = len;
+    E.map.heap = heap;
+    editor_map_index(MAP_INDEX_SLICE);
+    editor_hl_worker_start();
+}
+
+int editor_map_open(char *filename)
+{
+    struct stat st;
+    char *data = editor_map_file(filename, &st);
+    if(data == NULL) return -1;
+    editor_map_set(data, st.st_size, 0);
+    E.map.st = st;
+    return 0;
+}
+
+//forget every row and the mapping behind them
+void editor_map_close()
+{
+    editor_hl_worker_stop();
+    editor_search_cancel();
+    editor_rows_free_all();
+    if(E.map.data) {
+        if(E.map.heap) free(E.map.data);
+        else munmap(E.map.data, E.map.len);
+    }
+    free(E.map.eol);
+    memset(&E.map, 0, sizeof(E.map));
+    E.edit_from = INT_MAX;
+}
+
+/*** sytax highlighting ***/
+
+unsigned char separators[256];
+
+void init_separators()
+{
+    for(int c = 0; c < 256; c++)
+        separators[c] = isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+int is_separator(int c) 
+{
+    return separators[(unsigned char)c];
+}
+
+unsigned int syntax_keyword_hash(const char *s, int len)
+{
+    return (unsigned char)s[0] * 31 + (unsigned char)s[len - 1] * 17 + len;
+}
+
+//hash the keywords of s into a table that is grown until no two keywords share a slot,
+//so looking up a word takes a single probe and one compare
+void editor_syntax_compile(struct editor_syntax *s)
+{
+    if(s->kwtab) return;
+
+    int n = 0;
+    while(s->keywords[n]) n++;
+
+    unsigned int size = 16;
+    while(size < 2 * (unsigned int)n) size <<= 1;
+    for(;;) {
+        s->kwtab = calloc(size, sizeof(struct syntax_keyword));
+        if(s->kwtab == NULL) die("calloc");
+        s->kwmask = size - 1;
+        s->kwmin = INT_MAX;
+        s->kwmax = 0;
+
+        bool perfect = 1;
+        for(int j = 0; j < n; j++) {
+            char *word = s->keywords[j];
+            int len = strlen(word);
+            int hl = HL_KEYWORD1;
+            if(len && word[len - 1] == '|') {
+                hl = HL_KEYWORD2;
+                len--;
+            }
+            if(len == 0) continue;
+
+            unsigned int h = syntax_keyword_hash(word, len) & s->kwmask;
+            if(s->kwtab[h].word) perfect = 0;
+            while(s->kwtab[h].word) h = (h + 1) & s->kwmask;
+            s->kwtab[h].word = word;
+            s->kwtab[h].len = len;
+            s->kwtab[h].hl = hl;
+            if(len < s->kwmin) s->kwmin = len;
+            if(len > s->kwmax) s->kwmax = len;
+        }
+        //past a few thousand slots a collision is cheaper than more memory
+        if(perfect || size >= 4096) break;
+        free(s->kwtab);
+        size <<= 1;
+    }
+}
+
+//the highlight class of the keyword that is exactly word, or 0
+int editor_syntax_keyword(char *word, int len)
+{
+    struct editor_syntax *s = E.syntax;
+    if(len < s->kwmin || len > s->kwmax) return 0;
+
+    unsigned int h = syntax_keyword_hash(word, len) & s->kwmask;
+    while(s->kwtab[h].word) {
+        if(s->kwtab[h].len == len && !memcmp(s->kwtab[h].word, word, len))
+            return s->kwtab[h].hl;
+        h = (h + 1) & s->kwmask;
+    }
+    return 0;
+}
+
+//highlight text from from in state *st, up to the first token boundary at or past to, and return
+//it with *st set to the state there. hl[i - from] gets the class of text[i], and must have room for
+//a token that starts before to and runs past it. text is never read past len, so it may be a
+//row still in the mapped file
+int editor_syntax_scan_from(char *text, int len, int from, int to, unsigned char *hl, struct hl_state *st)
+{
+    memset(hl, HL_NORMAL, to - from);
+
+    if(E.syntax == NULL) return to;
+    if(st->line_comment) {
+        memset(hl, HL_COMMENT, to - from);
+        return len;
+    }
+
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+    
+    bool in_comment = st->in_comment;
+    char in_string = st->in_string;
+    bool prev_sep = st->prev_sep;
+
+    int i = from;
+    while(i < to) {
+        char c = text[i];
+        unsigned char prev_hl = (i > from) ? hl[i - from - 1] : st->prev_hl;
+
+        //check for singleline comment
+        //when in multiline comment, singleline comment shouldn't be recognized
+        if(scs_len && !in_string && !in_comment) {
+            if(c == scs[0] && i + scs_len <= len && !memcmp(&text[i], scs, scs_len)) {
+                memset(&hl[i - from], HL_COMMENT, to - i);
+                *st = (struct hl_state){0, 0, prev_sep, 1, HL_COMMENT};
+                return len;
+            }
+        }
+
+        //check for multiline comment
+        if(mcs_len && mce_len && !in_string) {
+            if(in_comment) {
+                hl[i - from] = HL_MLCOMMENT;
+                if(c == mce[0] && i + mce_len <= len && !memcmp(&text[i], mce, mce_len)) {
+                    memset(&hl[i - from], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+                    continue;
+                } else {
+                    i++;
+                    continue;
+                }
+            } else if(c == mcs[0] && i + mcs_len <= len && !memcmp(&text[i], mcs, mcs_len)) {
+                memset(&hl[i - from], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+        //check for strings
+        if(E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
             if(in_string) {  //in_string is either ' or "
-                row->hl[i] = HL_STRING;
-                if(c == '\\' && i + 1 < row->size) {
-                    row->hl[i + 1] = HL_STRING;
+                hl[i - from] = HL_STRING;
+                if(c == '\\' && i + 1 < len) {
+                    hl[i - from + 1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -416,7 +1777,7 @@ void editor_update_syntax(erow *row)
             } else {
                 if(c == '"' || c == '\'') {
                     in_string = c;
-                    row->hl[i] = HL_STRING;
+                    hl[i - from] = HL_STRING;
                     i++;
                     continue;
                 }
@@ -426,29 +1787,21 @@ void editor_update_syntax(erow *row)
         //check for numbers
         if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
             if((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
+                hl[i - from] = HL_NUMBER;
                 i++;
                 prev_sep = 0;
                 continue;
             }
         }
 
-        //check for keywords
-        if(prev_sep) {
-            int j;
-            for(j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if(kw2) klen--;
-
-                if(!strncmp(&row->render[i], keywords[j], klen) &&
-                   is_separator(row->render[i + klen])) {
-                       memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                       i += klen;
-                       break;
-                   }
-            }
-            if(keywords[j] != NULL) {
+        //check for keywords, a keyword is a whole word that runs up to the next separator
+        if(prev_sep && !is_separator(c)) {
+            int klen = 1;
+            while(i + klen < len && klen <= E.syntax->kwmax && !is_separator(text[i + klen])) klen++;
+            int kw = editor_syntax_keyword(&text[i], klen);
+            if(kw) {
+                memset(&hl[i - from], kw, klen);
+                i += klen;
                 prev_sep = 0;
                 continue;
             }
@@ -457,341 +1810,2772 @@ void editor_update_syntax(erow *row)
         i++;
     }
 
-    //since a user could comment out the entire file by changing one line, we should check if lines below need to be rerendered recursively
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if(changed && row->idx + 1 < E.numrows)
-        editor_update_syntax(&E.row[row->idx + 1]);
+    st->in_comment = in_comment;
+    st->in_string = in_string;
+    st->prev_sep = prev_sep;
+    if(i > from) st->prev_hl = hl[i - from - 1];
+    return i;
 }
 
-int editor_syntax_to_color(int hl)
+//highlight render into hl starting in the given comment state, returns the state at the end of the row
+bool editor_syntax_scan(char *render, int rsize, unsigned char *hl, bool in_comment)
 {
-    switch(hl) {
-        case HL_COMMENT:
-        case HL_MLCOMMENT: return 36;
-        case HL_KEYWORD1: return 33;
-        case HL_KEYWORD2: return 32;
-        case HL_STRING: return 35;
-        case HL_NUMBER: return 31;
-        case HL_MATCH: return 34;
-        default: return 37;
+    struct hl_state st = {in_comment, 0, 1, 0, HL_NORMAL};
+    editor_syntax_scan_from(render, rsize, 0, rsize, hl, &st);
+    return st.in_comment;
+}
+
+//the column n bytes of s take the cursor to from rx, tabs going on to the next tab stop
+int editor_text_width(char *s, int n, int rx)
+{
+    char *end = s + n;
+    char *tab;
+    while((tab = memchr(s, '\t', end - s))) {
+        rx += tab - s;
+        rx += E.KILO_TAB_STOP - rx % E.KILO_TAB_STOP;
+        s = tab + 1;
     }
+    return rx + (end - s);
 }
 
-void editor_select_syntax_highlight()
+bool hl_state_equal(struct hl_state *a, struct hl_state *b)
 {
-    E.syntax = NULL;
-    if(E.filename == NULL) return;
+    return a->in_comment == b->in_comment && a->in_string == b->in_string &&
+           a->prev_sep == b->prev_sep && a->line_comment == b->line_comment &&
+           a->prev_hl == b->prev_hl;
+}
 
-    char *ext = strrchr(E.filename, '.');
+void editor_row_index_reset(erow *row, bool start)
+{
+    struct row_index *ix = row->index;
+    ix->m[0] = (struct row_mark){0, 0, {start, 0, 1, 0, HL_NORMAL}};
+    ix->n = ix->valid = 1;
+    ix->start = start;
+    ix->complete = 0;
+}
 
-    for(unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct editor_syntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while(s->filematch[i]) {
-            int is_ext = s->filematch[i][0] == '.';
-            if((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-               (!is_ext && strstr(E.filename, s->filematch[i]))) {
-                   E.syntax = s;
+//the marks of a long row, made the first time they are needed
+struct row_index *editor_row_marks(erow *row)
+{
+    if(row->index == NULL) {
+        row->index = calloc(1, sizeof(struct row_index));
+        if(row->index == NULL) die("calloc");
+        row->index->cap = 16;
+        row->index->m = malloc(sizeof(struct row_mark) * row->index->cap);
+        if(row->index->m == NULL) die("malloc");
+        editor_row_index_reset(row, 0);
+    }
+    return row->index;
+}
 
-                   int filerow;
-                   for(filerow = 0; filerow < E.numrows; filerow++) {
-                       editor_update_syntax(&E.row[filerow]);
-                   }
-                   return;
-               }
-            i++;
+void editor_row_index_free(erow *row)
+{
+    if(row->index == NULL) return;
+    free(row->index->m);
+    free(row->index);
+    row->index = NULL;
+}
+
+void editor_row_mark_insert(struct row_index *ix, int at, struct row_mark *m)
+{
+    if(ix->n == ix->cap) {
+        ix->cap *= 2;
+        ix->m = realloc(ix->m, sizeof(struct row_mark) * ix->cap);
+        if(ix->m == NULL) die("realloc");
+    }
+    memmove(&ix->m[at + 1], &ix->m[at], sizeof(struct row_mark) * (ix->n - at));
+    ix->m[at] = *m;
+    ix->n++;
+}
+
+//text was inserted at at (d > 0) or d bytes deleted from there (d < 0). marks past the change
+//move along with the text, to be compared with when the row is scanned again. marks the change
+//may have reached through a token running into it can't be trusted anymore. marks an earlier
+//change moved are dropped, they could only be compared with the text as it was before that one
+void editor_row_index_edit(erow *row, int at, int d)
+{
+    struct row_index *ix = row->index;
+    if(ix == NULL) return;
+    ix->edited = 1;
+    if(ix->valid < ix->n) {
+        ix->n = ix->valid;
+        ix->complete = 0;
+    }
+    int reach = at - ROW_SCAN_REACH - (E.syntax ? E.syntax->kwmax : 0);
+    int moved = d < 0 ? at - d : at;  //marks from here on move
+    int n = 1, valid = 1;
+    for(int j = 1; j < ix->n; j++) {
+        struct row_mark m = ix->m[j];
+        if(m.cx >= moved) m.cx += d;
+        else if(m.cx > reach) continue;
+        else valid = n + 1;
+        ix->m[n++] = m;
+    }
+    ix->n = n;
+    ix->valid = valid;
+    //with no mark past the change to pick up the old state from, the end has to be scanned again
+    if(ix->valid == ix->n) ix->complete = 0;
+}
+
+//bring the marks of a long row up to date as far as upto, scanning on from the last good one.
+//once the state at a mark an edit moved comes out as it was, the rest of the row highlights as
+//it did before too, and the marks past it only need their columns brought along
+void editor_row_index_build(erow *row, int upto)
+{
+    static unsigned char *hl = NULL;
+    static int hlcap = 0;
+
+    int need = ROW_SEGMENT + ROW_SCAN_REACH + (E.syntax ? E.syntax->kwmax : 0);
+    if(hlcap < need) {
+        hl = realloc(hl, need);
+        if(hl == NULL) die("realloc");
+        hlcap = need;
+    }
+
+    struct row_index *ix = row->index;
+    int k = ix->valid - 1;
+    while(!(ix->complete && ix->valid == ix->n) && ix->m[k].cx < upto) {
+        struct row_mark *prev = &ix->m[k];
+        struct row_mark m = *prev;
+        int to = prev->cx + ROW_SEGMENT;
+        if(k + 1 < ix->n && ix->m[k + 1].cx < to) to = ix->m[k + 1].cx;
+        if(to > row->size) to = row->size;
+        m.cx = editor_syntax_scan_from(row->chars, row->size, prev->cx, to, hl, &m.st);
+        if(m.cx >= row->size) {
+            ix->n = ix->valid = k + 1;
+            ix->end = m.st;
+            ix->complete = 1;
+            return;
         }
+        m.rx = editor_text_width(row->chars + prev->cx, m.cx - prev->cx, prev->rx);
+
+        //moved marks the scan went past can't be compared with
+        int j = k + 1;
+        while(j < ix->n && ix->m[j].cx < m.cx) j++;
+        memmove(&ix->m[k + 1], &ix->m[j], sizeof(struct row_mark) * (ix->n - j));
+        ix->n -= j - (k + 1);
+
+        if(k + 1 < ix->n && ix->m[k + 1].cx == m.cx && hl_state_equal(&ix->m[k + 1].st, &m.st)) {
+            int delta = m.rx - ix->m[k + 1].rx;
+            ix->m[k + 1].rx = m.rx;
+            for(j = k + 2; j < ix->n; j++) {
+                //tabs only come out the same width if the text moved by whole tab stops
+                if(delta % E.KILO_TAB_STOP == 0) ix->m[j].rx += delta;
+                else ix->m[j].rx = editor_text_width(row->chars + ix->m[j - 1].cx,
+                                                     ix->m[j].cx - ix->m[j - 1].cx, ix->m[j - 1].rx);
+            }
+            ix->valid = ix->n;
+            k = ix->n - 1;
+            continue;
+        }
+        if(k + 1 < ix->n && ix->m[k + 1].cx == m.cx) ix->m[k + 1] = m;
+        else editor_row_mark_insert(ix, k + 1, &m);
+        k++;
+        ix->valid = k + 1;
+        //past the last moved mark without the state coming out as before, the end is scanned again
+        if(ix->valid == ix->n) ix->complete = 0;
     }
 }
-/*** row operations ***/
 
-int deciLength(int num) {
-    int ret = 0;
-    if(!num) return 1;
-    do {
-        ++ret;
-    } while(num /= 10);
-    return ret;
+//the last good mark of a long row at or before column at, of the text when by_rx is 0 or of
+//the render otherwise
+struct row_mark *editor_row_mark_before(erow *row, int at, bool by_rx)
+{
+    struct row_index *ix = editor_row_marks(row);
+    //a mark's render column is never less than its text column
+    editor_row_index_build(row, at);
+    int lo = 0, hi = ix->valid - 1;
+    while(lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if((by_rx ? ix->m[mid].rx : ix->m[mid].cx) <= at) lo = mid;
+        else hi = mid - 1;
+    }
+    return &ix->m[lo];
+}
+
+//comment state at the end of row when it starts in in_comment. a long row is scanned from its
+//marks, which an edit leaves in place up to where it happened
+bool editor_row_end_state(erow *row, bool in_comment)
+{
+    static char *render = NULL;
+    static unsigned char *hl = NULL;
+    static int cap = 0, hlcap = 0;
+
+    if(row->size > ROW_LONG) {
+        struct row_index *ix = editor_row_marks(row);
+        if(ix->start != in_comment) editor_row_index_reset(row, in_comment);
+        editor_row_index_build(row, INT_MAX);
+        return ix->end.in_comment;
+    }
+
+    int rsize = editor_row_expand(row, &render, &cap);
+    if(hlcap < cap) {
+        hl = realloc(hl, cap);
+        if(hl == NULL) die("realloc");
+        hlcap = cap;
+    }
+    return editor_syntax_scan(render, rsize, hl, in_comment);
+}
+
+//comment state at the start of row, or -2 when it's still to come from the background pass
+int editor_row_start_state(erow *row)
+{
+    row_node *prev = row_node_prev(ROW_NODE(row));
+    if(prev == NULL) return 0;
+    if(prev->span) {
+        int state = editor_span_state(prev, prev->span);
+        if(state != -1) return state;
+        //the published state doesn't hold anymore, the lines above have to be loaded after all
+        prev = ROW_NODE(editor_row_prev(row));
+    }
+    if(prev->row.hl_pending) {
+        prev->row.hl_pending = 0;
+        prev->row.hl_open_comment = editor_row_end_state(&prev->row, editor_row_start_state(&prev->row) == 1);
+    }
+    return prev->row.hl_open_comment;
+}
+
+bool editor_row_starts_in_comment(erow *row)
+{
+    return editor_row_start_state(row) == 1;
+}
+
+//the start state of a stale row can be worked out without waiting for the background pass
+bool editor_syntax_ready(erow *row)
+{
+    row_node *prev = row_node_prev(ROW_NODE(row));
+    return prev == NULL || !prev->span || editor_span_state(prev, prev->span) != -2;
+}
+
+//remember a row whose comment state has to be recomputed later
+void editor_syntax_defer(erow *row)
+{
+    if(row->hl_stale) return;
+    row->hl_stale = 1;
+    if(E.nstale == E.stale_cap) {
+        E.stale_cap = E.stale_cap ? E.stale_cap * 2 : 16;
+        E.stale = realloc(E.stale, sizeof(erow *) * E.stale_cap);
+        if(E.stale == NULL) die("realloc");
+    }
+    E.stale[E.nstale++] = row;
+}
+
+void editor_syntax_undefer(erow *row)
+{
+    if(!row->hl_stale) return;
+    row->hl_stale = 0;
+    for(int i = 0; i < E.nstale; i++) {
+        if(E.stale[i] == row) {
+            E.stale[i] = E.stale[--E.nstale];
+            break;
+        }
+    }
+}
+
+//recompute the comment state at the end of row and carry it down for as long as it keeps changing.
+//rows from limit on are only marked stale, so an edit costs what is on screen and not the rest of the file.
+//only the state is kept, the colors are produced when the row is drawn
+void editor_syntax_propagate(erow *row, int limit)
+{
+    int at = editor_row_index(row);
+    for(;;) {
+        //taken first, it may load rows above which rehighlight this one with the same buffers
+        int start = editor_row_start_state(row);
+        //nothing takes the state at the end of the last row, so a long one, where a quote
+        //typed near the start changes how all the rest of it scans, leaves it for a row added below
+        if(row->size > ROW_LONG && start != -2 && row_node_next(ROW_NODE(row)) == NULL) {
+            editor_syntax_undefer(row);
+            row->hl_pending = 1;
+            return;
+        }
+        perf_push(PERF_HIGHLIGHT);
+        bool in_comment = editor_row_end_state(row, start == 1);
+        perf_pop();
+        editor_syntax_undefer(row);
+        //until the background pass reaches the row its start state is a guess
+        if(start == -2) editor_syntax_defer(row);
+
+        //the row below starts in the same state as before, nothing further down changes
+        row->hl_pending = 0;
+        if(row->hl_open_comment == in_comment) return;
+        row->hl_open_comment = in_comment;
+
+        row_node *next = row_node_next(ROW_NODE(row));
+        if(next && next->span) {
+            //rows that aren't loaded yet pick up the state when they are, but a row past them
+            //may have been loaded with what the background pass saw, which no longer holds
+            while(next && next->span) next = row_node_next(next);
+            if(next) editor_syntax_defer(&next->row);
+            return;
+        }
+        if(next == NULL) return;
+        row = &next->row;
+        at++;
+        editor_row_drop_render(row);
+        if(at >= limit) {
+            editor_syntax_defer(row);
+            return;
+        }
+    }
+}
+
+void editor_update_syntax(erow *row)
+{
+    TRACE_SCOPE_ARG("editor_update_syntax", editor_row_index(row));
+    if(E.syntax == NULL) return;
+    editor_syntax_propagate(row, E.rowoff + E.screenrows);
+}
+
+//work out the comment state at the end of n consecutive loaded rows in one pass, rather than
+//propagating from each in turn. the last one carries it on below as after any edit
+void editor_syntax_run(erow *row, int n)
+{
+    if(E.syntax == NULL) return;
+    int start = editor_row_start_state(row);
+    bool in_comment = start == 1;
+    for(int i = 0; i < n - 1; i++) {
+        perf_push(PERF_HIGHLIGHT);
+        in_comment = editor_row_end_state(row, in_comment);
+        perf_pop();
+        row->hl_open_comment = in_comment;
+        row->hl_pending = 0;
+        if(i == 0) {
+            editor_syntax_undefer(row);
+            if(start == -2) editor_syntax_defer(row);
+        }
+        row = &row_node_next(ROW_NODE(row))->row;
+    }
+    editor_syntax_propagate(row, E.rowoff + E.screenrows);
+}
+
+//rehighlight the stale rows above limit, so every row up to there starts in the right state
+void editor_syntax_catch_up(int limit)
+{
+    int i = 0;
+    while(i < E.nstale) {
+        erow *row = E.stale[i];
+        if(editor_row_index(row) < limit && editor_syntax_ready(row)) {
+            editor_row_drop_render(row);
+            editor_syntax_propagate(row, limit);
+            i = 0;  //the propagation may have taken other rows off the list
+        } else {
+            i++;
+        }
+    }
+}
+
+//work through the stale rows while no key is waiting. rows waiting for the background pass
+//are picked up as it gets to them, and the screen is redrawn when they are on it
+void editor_syntax_idle()
+{
+    int timeout = 0;
+    while(E.nstale && !editor_input_pending(timeout)) {
+        erow *row = NULL;
+        for(int i = 0; i < E.nstale && row == NULL; i++)
+            if(editor_syntax_ready(E.stale[i])) row = E.stale[i];
+        if(row == NULL) {
+            if(!editor_hl_worker_busy()) break;
+            timeout = 10;
+            continue;
+        }
+        timeout = 0;
+
+        int at = editor_row_index(row);
+        if(at < E.rowoff + E.screenrows)
+            editor_refresh_screen();  //which catches up with what's on screen
+        else
+            editor_syntax_catch_up(at + SYNTAX_IDLE_SLICE);
+    }
+}
+
+int editor_syntax_to_color(int hl)
+{
+    switch(hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 36;
+        case HL_KEYWORD1: return 33;
+        case HL_KEYWORD2: return 32;
+        case HL_STRING: return 35;
+        case HL_NUMBER: return 31;
+        case HL_MATCH: return 34;
+        default: return 37;
+    }
+}
+
+void editor_select_syntax_highlight()
+{
+    E.syntax = NULL;
+    if(E.filename == NULL) return;
+
+    char *ext = strrchr(E.filename, '.');
+
+    for(unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        struct editor_syntax *s = &HLDB[j];
+        unsigned int i = 0;
+        while(s->filematch[i]) {
+            int is_ext = s->filematch[i][0] == '.';
+            if((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+               (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                   E.syntax = s;
+                   editor_syntax_compile(s);
+
+                   erow *row;
+                   for(row = editor_row_at(0); row; row = editor_row_next(row)) {
+                       editor_update_row(row);
+                   }
+                   return;
+               }
+            i++;
+        }
+    }
+}
+/*** background highlighting ***/
+
+//the states are kept in blocks made as the pass gets to them, so their memory follows the lines
+//found rather than the size of the file. blocks never move, the lines published can be read as
+//more are added
+void hl_worker_set(struct hl_worker *w, int line, unsigned char state)
+{
+    unsigned char **b = &w->start[line / HL_WORKER_BLOCK];
+    if(*b == NULL && (*b = malloc(HL_WORKER_BLOCK)) == NULL) die("malloc");
+    (*b)[line % HL_WORKER_BLOCK] = state;
+}
+
+void hl_worker_free(struct hl_worker *w)
+{
+    for(size_t i = 0; i < w->nblocks; i++)
+        free(w->start[i]);
+    free(w->start);
+    w->start = NULL;
+    w->nblocks = 0;
+}
+
+void *editor_hl_worker_run(void *arg)
+{
+    TRACE_THREAD("highlight");
+    TRACE_SCOPE("editor_hl_worker_run");
+    struct hl_worker *w = arg;
+    char *render = NULL;
+    unsigned char *hl = NULL;
+    int cap = 0, hlcap = 0;
+    char *p = w->data, *end = w->data + w->len;
+    int line = 0;
+    bool in_comment = 0;
+    bool stop = 0;
+
+    while(p < end && !stop) {
+        //split the lines the same way editor_map_line does
+        char *nl = memchr(p, '\n', end - p);
+        char *eol = nl ? nl : end;
+        erow row;
+        memset(&row, 0, sizeof(row));
+        row.chars = p;
+        row.size = eol - p;
+        while(row.size > 0 && (p[row.size - 1] == '\n' || p[row.size - 1] == '\r'))
+            row.size--;
+
+        int rsize = editor_row_expand(&row, &render, &cap);
+        if(hlcap < cap) {
+            hl = realloc(hl, cap);
+            if(hl == NULL) die("realloc");
+            hlcap = cap;
+        }
+        in_comment = editor_syntax_scan(render, rsize, hl, in_comment);
+        hl_worker_set(w, ++line, in_comment);
+        p = nl ? nl + 1 : end;
+
+        if(line % HL_WORKER_BATCH == 0 || p == end) {
+            pthread_mutex_lock(&w->lock);
+            w->known = line + 1;
+            w->done = p == end;
+            stop = w->stop;
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    free(render);
+    free(hl);
+    return NULL;
+}
+
+//start scanning the mapped file in the background, when there's something to highlight
+void editor_hl_worker_start()
+{
+    struct hl_worker *w = &E.hl_worker;
+    if(E.syntax == NULL || E.map.data == NULL || w->running) return;
+
+    w->data = E.map.data;
+    w->len = E.map.len;
+    //there is at most one line per byte, and one more after the last
+    w->nblocks = (w->len + 1) / HL_WORKER_BLOCK + 1;
+    w->start = calloc(w->nblocks, sizeof(unsigned char *));
+    if(w->start == NULL) return;
+    hl_worker_set(w, 0, 0);
+    w->known = 1;  //the first line starts outside of comments
+    w->done = 0;
+    w->stop = 0;
+    pthread_mutex_init(&w->lock, NULL);
+    //without the thread the rows are loaded in order, as they always were
+    if(pthread_create(&w->thread, NULL, editor_hl_worker_run, w) != 0) {
+        pthread_mutex_destroy(&w->lock);
+        hl_worker_free(w);
+        return;
+    }
+    w->running = 1;
+}
+
+//stop the background pass, it has to be done before the text it reads is unmapped
+void editor_hl_worker_stop()
+{
+    struct hl_worker *w = &E.hl_worker;
+    if(!w->running) return;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    hl_worker_free(w);
+    w->running = 0;
+}
+
+bool editor_hl_worker_busy()
+{
+    struct hl_worker *w = &E.hl_worker;
+    if(!w->running) return 0;
+    pthread_mutex_lock(&w->lock);
+    bool busy = !w->done;
+    pthread_mutex_unlock(&w->lock);
+    return busy;
+}
+
+//comment state the background pass found at the start of mapped line,
+//-2 while it hasn't got there yet and -1 if it never will
+int editor_hl_worker_state(int line)
+{
+    struct hl_worker *w = &E.hl_worker;
+    if(!w->running) return -1;
+    pthread_mutex_lock(&w->lock);
+    int known = w->known;
+    pthread_mutex_unlock(&w->lock);
+    return line < known ? w->start[line / HL_WORKER_BLOCK][line % HL_WORKER_BLOCK] : -2;
+}
+
+//comment state at the start of line off of span, taken from the background pass.
+//-2 while that isn't known yet, -1 when edits above have made the published state wrong
+int editor_span_state(row_node *span, int off)
+{
+    //the state comes down from the last loaded row above, all spans in between are followed
+    row_node *n = span, *prev;
+    while((prev = row_node_prev(n)) && prev->span) n = prev;
+    if(prev && prev->row.hl_stale) return -2;
+    int state = prev ? prev->row.hl_open_comment : 0;
+
+    for(;;) {
+        int seen = editor_hl_worker_state(n->line);
+        if(seen < 0) return seen;
+        if(seen != state) return -1;
+        state = editor_hl_worker_state(n->line + (n == span ? off : n->span));
+        if(state < 0 || n == span) return state;
+        n = row_node_next(n);
+    }
+}
+
+/*** row operations ***/
+
+int deciLength(int num) {
+    int ret = 0;
+    if(!num) return 1;
+    do {
+        ++ret;
+    } while(num /= 10);
+    return ret;
+}
+
+int editor_row_cx_to_rx(erow *row, int cx)
+{
+    if(row->size > ROW_LONG) {
+        struct row_mark *m = editor_row_mark_before(row, cx, 0);
+        return editor_text_width(row->chars + m->cx, cx - m->cx, m->rx);
+    }
+    int rx = 0;
+    int j;
+    for(j = 0; j < cx; j++) {
+        if(row->chars[j] == '\t')
+            rx += (E.KILO_TAB_STOP - 1) - (rx % E.KILO_TAB_STOP);
+        rx++;
+    }
+    return rx;
+}
+
+int editor_row_rx_to_cx(erow *row, int rx)
+{
+    int cur_rx = 0;
+    int cx = 0;
+    if(row->size > ROW_LONG) {
+        struct row_mark *m = editor_row_mark_before(row, rx, 1);
+        cx = m->cx;
+        cur_rx = m->rx;
+    }
+    for(; cx < row->size; cx++) {
+        if(row->chars[cx] == '\t')
+            cur_rx += (E.KILO_TAB_STOP - 1) - (cur_rx % E.KILO_TAB_STOP);
+        cur_rx++;
+        if(cur_rx > rx) return cx;
+    }
+    return cx;
+}
+
+//expand the tabs of row into *buf, growing it as needed, returns the rendered length
+int editor_row_expand(erow *row, char **buf, int *cap)
+{
+    int tabs = 0;
+    int j = 0;
+    for(j = 0; j < row->size; j++)
+        if(row->chars[j] == '\t') tabs++;
+
+    int need = row->size + tabs * (E.KILO_TAB_STOP - 1) + 1; //row->size already counts 1 for each tab
+    if(need > *cap) {
+        *buf = realloc(*buf, need);
+        if(*buf == NULL) die("realloc");
+        *cap = need;
+    }
+
+    char *render = *buf;
+    int idx = 0;
+    for(j = 0; j <row->size; j++) {
+        if(row->chars[j] == '\t') {
+            render[idx++] = ' ';
+            while(idx % E.KILO_TAB_STOP != 0) render[idx++] = ' ';
+        } else 
+            render[idx++] = row->chars[j];
+    }
+    render[idx] = '\0';
+    return idx;
+}
+
+//drop the renders of rows that weren't on screen in the last frame
+void editor_trim_render_cache()
+{
+    int i, kept = 0;
+    for(i = 0; i < E.nrendered; i++) {
+        erow *row = E.rendered[i];
+        if(row->drawn == E.frame) {
+            E.rendered[kept++] = row;
+        } else {
+            free(row->render);
+            free(row->hl);
+            row->render = NULL;
+            row->hl = NULL;
+            row->rsize = 0;
+        }
+    }
+    E.nrendered = kept;
+}
+
+//keep the render of row in the cache, where it stays while the row is on screen
+void editor_row_cache(erow *row)
+{
+    if(E.nrendered > 2 * E.screenrows + RENDER_CACHE_SLACK)
+        editor_trim_render_cache();
+    if(E.nrendered == E.rendered_cap) {
+        E.rendered_cap = E.rendered_cap ? E.rendered_cap * 2 : 64;
+        E.rendered = realloc(E.rendered, sizeof(erow *) * E.rendered_cap);
+        if(E.rendered == NULL) die("realloc");
+    }
+    E.rendered[E.nrendered++] = row;
+}
+
+//build render and hl for a row about to be shown or searched,
+//they are kept only while the row stays on screen
+void editor_row_prepare(erow *row)
+{
+    if(row->render && row->rcols == 0) return;
+    editor_row_drop_render(row);
+
+    bool in_comment = E.syntax && editor_row_starts_in_comment(row);
+    int cap = 0;
+    row->rsize = editor_row_expand(row, &row->render, &cap);
+    row->roff = row->rcols = 0;
+    row->hl = malloc(row->rsize ? row->rsize : 1);
+    perf_push(PERF_HIGHLIGHT);
+    editor_syntax_scan(row->render, row->rsize, row->hl, in_comment);
+    perf_pop();
+    editor_row_cache(row);
+}
+
+//build render and hl for a row about to be drawn from column rx on, n columns wide. a long row
+//only gets those columns, expanded and highlighted from the mark before them, so that a row
+//far wider than the screen costs about the width of the screen to draw
+void editor_row_prepare_cols(erow *row, int rx, int n)
+{
+    static unsigned char *hl = NULL;
+    static int hlcap = 0;
+
+    if(row->size <= ROW_LONG) {
+        editor_row_prepare(row);
+        return;
+    }
+    if(row->render && (row->rcols == 0 || (rx >= row->roff && rx + n <= row->roff + row->rcols))) return;
+    editor_row_drop_render(row);
+
+    bool in_comment = E.syntax && editor_row_starts_in_comment(row);
+    struct row_index *ix = editor_row_marks(row);
+    if(ix->start != in_comment) editor_row_index_reset(row, in_comment);
+    struct row_mark m = *editor_row_mark_before(row, rx, 1);
+
+    //the text from the mark up to the last column shown
+    int cx = m.cx, col = m.rx;
+    while(cx < row->size && col < rx + n) {
+        if(row->chars[cx] == '\t') col += E.KILO_TAB_STOP - col % E.KILO_TAB_STOP;
+        else col++;
+        cx++;
+    }
+    int need = cx - m.cx + ROW_SCAN_REACH + (E.syntax ? E.syntax->kwmax : 0);
+    if(hlcap < need) {
+        hl = realloc(hl, need);
+        if(hl == NULL) die("realloc");
+        hlcap = need;
+    }
+    perf_push(PERF_HIGHLIGHT);
+    editor_syntax_scan_from(row->chars, row->size, m.cx, cx, hl, &m.st);
+    perf_pop();
+
+    row->render = malloc(n + 1);
+    row->hl = malloc(n ? n : 1);
+    if(row->render == NULL || row->hl == NULL) die("malloc");
+    int len = 0;
+    col = m.rx;
+    for(int j = m.cx; j < cx; j++) {
+        char c = row->chars[j];
+        int w = 1;
+        if(c == '\t') {
+            c = ' ';
+            w = E.KILO_TAB_STOP - col % E.KILO_TAB_STOP;
+        }
+        for(; w > 0; w--, col++) {
+            if(col < rx || len == n) continue;
+            row->render[len] = c;
+            row->hl[len++] = hl[j - m.cx];
+        }
+    }
+    row->render[len] = '\0';
+    row->rsize = len;
+    row->roff = rx;
+    row->rcols = n;
+    editor_row_cache(row);
+}
+
+void editor_row_drop_render(erow *row)
+{
+    if(row->render == NULL) return;
+    free(row->render);
+    free(row->hl);
+    row->render = NULL;
+    row->hl = NULL;
+    row->rsize = 0;
+
+    for(int i = 0; i < E.nrendered; i++) {
+        if(E.rendered[i] == row) {
+            E.rendered[i] = E.rendered[--E.nrendered];
+            break;
+        }
+    }
+}
+
+void editor_update_row(erow *row)
+{
+    TRACE_SCOPE_ARG("editor_update_row", editor_row_index(row));
+    //a change that didn't move the marks along itself leaves them to be made again
+    if(row->index) {
+        if(!row->index->edited) editor_row_index_reset(row, row->index->start);
+        row->index->edited = 0;
+    }
+    //the render is rebuilt the next time the row is looked at
+    editor_row_drop_render(row);
+    editor_update_syntax(row);
+}
+
+void editor_update_row_offset() {
+    E.screencols += (E.row_num_offset + 1);
+    E.row_num_offset = deciLength(E.numrows);
+    E.screencols -= (E.row_num_offset + 1);
+}
+
+//count an edit of row at, and remember the first row edited since the file was read
+void editor_mark_dirty(int at)
+{
+    E.dirty++;
+    if(at < E.edit_from) E.edit_from = at;
+}
+
+void editor_insert_row(int at, char *s, size_t len, int leading_sps)
+{
+    if(at < 0 || at > E.numrows) return;
+
+    erow *row = editor_rows_insert(at);
+    row->size = len + leading_sps;
+    row->chars = malloc(len + leading_sps + 1);
+    for(int i = 0; i < leading_sps; ++i) {
+        row->chars[i] = ' ';
+    }
+    memcpy(row->chars + leading_sps, s, len);
+    row->chars[len + leading_sps] = '\0';
+
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hl_open_comment = 0;
+    editor_update_row(row);
+    if(E.options & ENABLE_LINE_NUM) {
+        editor_update_row_offset();
+    }
+    editor_mark_dirty(at);
+}
+
+void editor_free_row(erow *row)
+{
+    if(editor_row_frozen(row)) editor_save_retire(row->chars);
+    else if(!row->mapped) free(row->chars);
+    editor_row_drop_render(row);
+    editor_row_index_free(row);
+    editor_syntax_undefer(row);
+}
+
+void editor_del_row(int at)
+{
+    if(at < 0 || at >= E.numrows) return;
+    erow *row = editor_rows_remove(at);
+    editor_free_row(row);
+    editor_rows_release(row);
+    editor_mark_dirty(at);
+}
+
+//copy a row that still points into the mapped file, or whose text a save is writing out,
+//into a buffer of its own
+void editor_row_own(erow *row)
+{
+    bool frozen = editor_row_frozen(row);
+    if(!row->mapped && !frozen) return;
+    char *chars = malloc(row->size + 1);
+    if(chars == NULL) die("malloc");
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    if(frozen) editor_save_retire(row->chars);
+    row->chars = chars;
+    row->cap = 0;
+    row->mapped = 0;
+}
+
+void editor_row_insert_char(erow *row, int at, int c)
+{
+    if(at < 0 || at > row->size) at = row->size;
+    editor_row_own(row);
+    //grown by half again, so typing into a long row doesn't copy it on every key
+    if(row->size + 2 > row->cap) { //one for the new character, one for \0
+        row->cap = row->size + 2 + row->size / 2;
+        row->chars = realloc(row->chars, row->cap);
+        if(row->chars == NULL) die("realloc");
+    }
+    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    
+    row->size++;
+    row->chars[at] = c;
+    editor_row_index_edit(row, at, 1);
+    editor_update_row(row);
+    editor_mark_dirty(editor_row_index(row));
+}
+
+void editor_row_append_string(erow *row, char *s, size_t len)
+{
+    editor_row_own(row);
+    if(row->size + (int)len + 1 > row->cap) {
+        row->cap = row->size + len + 1;
+        row->chars = realloc(row->chars, row->cap);
+        if(row->chars == NULL) die("realloc");
+    }
+    memcpy(&row->chars[row->size], s, len);
+    editor_row_index_edit(row, row->size, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editor_update_row(row);
+    editor_mark_dirty(editor_row_index(row));
+}
+
+void editor_row_del_char(erow *row, int at)
+{
+    if(at < 0 || at >= row->size) return;
+    editor_row_own(row);
+    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    row->size--;
+    editor_row_index_edit(row, at, -1);
+    editor_update_row(row);
+    editor_mark_dirty(editor_row_index(row));
+}
+
+/*** editor operations ***/
+
+void editor_insert_char(int c)
+{
+    if(E.cy == E.numrows) {
+        editor_insert_row(E.numrows, "", 0, 0);
+    }
+    editor_row_insert_char(editor_row_at(E.cy), E.cx, c);
+    E.cx++;
+}
+
+void editor_del_char()
+{
+    //this function is like backspace
+    if(E.cy == E.numrows) return;
+    if(E.cx == 0 && E.cy == 0) return;
+
+    erow *row = editor_row_at(E.cy);
+    if(E.cx > 0) {
+        editor_row_del_char(row, E.cx - 1);
+        E.cx--;
+    } else {
+        erow *prev = editor_row_prev(row);
+        E.cx = prev->size;
+        editor_row_append_string(prev, row->chars, row->size);
+        editor_del_row(E.cy);
+        E.cy--;
+    }
+}
+
+int get_leading_sps(int line) {
+    int i;
+    erow *row = editor_row_at(line);
+    for(i = 0; i < row->size && (row->chars[i] == ' ' || row->chars[i] == '\t'); ++i);
+    return editor_row_cx_to_rx(row, i);
+}
+
+void editor_insert_new_line() // create a new line when typeing enter
+{
+    int leading_sps = 0;
+    if(E.options & ENABLE_AUTO_INDENT) {
+        leading_sps = get_leading_sps(E.cy);
+    }
+    if(E.cx == 0) {
+        editor_insert_row(E.cy, "", 0, leading_sps);
+    } else {
+        erow *row = editor_row_at(E.cy);
+        editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx, leading_sps);
+        editor_row_own(row);
+        editor_row_index_edit(row, E.cx, E.cx - row->size);
+        row->size = E.cx;
+        row->chars[row->size] = '\0';
+        editor_update_row(row);
+        editor_mark_dirty(E.cy);
+    }
+    E.cy++;
+    E.cx = leading_sps;
+}
+
+//the end of a line in pasted text, which terminals send as \r but may come as \n or \r\n.
+//returns where the next line starts, *eol is set to where this one ends
+size_t paste_line_end(char *s, size_t len, size_t from, size_t *eol)
+{
+    char *p = s + from;
+    char *end = s + len;
+    while(p < end && *p != '\r' && *p != '\n') p++;
+    *eol = p - s;
+    if(p == end) return len;
+    if(*p == '\r' && p + 1 < end && p[1] == '\n') p++;
+    return p + 1 - s;
+}
+
+//insert text at the cursor as a single edit, for a paste. the text is cut into lines in one
+//pass, the new rows are linked in as one block, and their highlighting is worked out once.
+//unlike typing it in, nothing is auto-indented
+void editor_insert_text(char *s, size_t len)
+{
+    if(len == 0) return;
+    if(E.cy == E.numrows)
+        editor_insert_row(E.numrows, "", 0, 0);
+
+    erow *row = editor_row_at(E.cy);
+    editor_row_own(row);
+    size_t eol;
+    size_t next = paste_line_end(s, len, 0, &eol);
+    int taillen = row->size - E.cx;
+
+    if(eol == len) {
+        //no line break, the text goes into the row
+        row->cap = row->size + len + 1;
+        row->chars = realloc(row->chars, row->cap);
+        if(row->chars == NULL) die("realloc");
+        memmove(&row->chars[E.cx + len], &row->chars[E.cx], taillen + 1);
+        memcpy(&row->chars[E.cx], s, len);
+        editor_row_index_edit(row, E.cx, len);
+        row->size += len;
+        E.cx += len;
+        editor_update_row(row);
+        editor_mark_dirty(E.cy);
+        return;
+    }
+
+    //the first line ends the row, what followed the cursor goes after the last line
+    char *tail = malloc(taillen + 1);
+    if(tail == NULL) die("malloc");
+    memcpy(tail, &row->chars[E.cx], taillen);
+    row->cap = E.cx + eol + 1;
+    row->chars = realloc(row->chars, row->cap);
+    if(row->chars == NULL) die("realloc");
+    memcpy(&row->chars[E.cx], s, eol);
+    row->size = E.cx + eol;
+    row->chars[row->size] = '\0';
+    editor_row_drop_render(row);
+    if(row->index) editor_row_index_reset(row, row->index->start);
+
+    //the other lines become rows of a treap of their own, merged in with one split
+    row_node *block = NULL;
+    int added = 0;
+    while(1) {
+        size_t from = next;
+        next = paste_line_end(s, len, from, &eol);
+        bool last = eol == len;
+        int size = eol - from + (last ? taillen : 0);
+        row_node *node = row_node_new(0, 0);
+        node->row.chars = malloc(size + 1);
+        if(node->row.chars == NULL) die("malloc");
+        memcpy(node->row.chars, s + from, eol - from);
+        if(last) memcpy(node->row.chars + eol - from, tail, taillen);
+        node->row.chars[size] = '\0';
+        node->row.size = size;
+        block = row_node_merge(block, node);
+        added++;
+        if(last) {
+            E.cx = eol - from;
+            break;
+        }
+    }
+    free(tail);
+
+    row_node *l, *r;
+    row_node_split(E.rows, E.cy + 1, &l, &r);
+    editor_rows_set_root(row_node_merge(row_node_merge(l, block), r));
+    editor_syntax_run(row, added + 1);
+    if(E.options & ENABLE_LINE_NUM) {
+        editor_update_row_offset();
+    }
+    editor_mark_dirty(E.cy);
+    E.cy += added;
+}
+
+/*** file i/o ***/
+
+//the text being saved is gathered into iovecs that point at the rows and the mapping,
+//and handed to writev a batch at a time, so saving copies nothing
+struct save_stream {
+    int fd;
+    struct iovec iov[SAVE_BATCH];
+    int n;
+    size_t bytes;
+    bool failed;
+    struct save_job *job;  //told how far the save got after every batch
+};
+
+//write out every byte the n iovecs point to, carrying on after short writes and interruptions
+int save_writev(int fd, struct iovec *iov, int n)
+{
+    while(n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if(w == -1) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        while(n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if(n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+void save_flush(struct save_stream *ss)
+{
+    if(ss->n && !ss->failed && save_writev(ss->fd, ss->iov, ss->n) == -1) ss->failed = 1;
+    ss->n = 0;
+    pthread_mutex_lock(&ss->job->lock);
+    ss->job->written = ss->bytes;
+    pthread_mutex_unlock(&ss->job->lock);
+}
+
+//add len bytes at p, joined to the last piece when they follow it in memory,
+//as the lines of the mapping that weren't edited do
+void save_push(struct save_stream *ss, char *p, size_t len)
+{
+    ss->bytes += len;
+    if(ss->n) {
+        struct iovec *last = &ss->iov[ss->n - 1];
+        if((char *)last->iov_base + last->iov_len == p) {
+            last->iov_len += len;
+            return;
+        }
+    }
+    if(ss->n == SAVE_BATCH) save_flush(ss);
+    ss->iov[ss->n].iov_base = p;
+    ss->iov[ss->n].iov_len = len;
+    ss->n++;
+}
+
+//add one line and the newline after it, the one in the mapping when the line is followed by it there
+void save_push_line(struct save_stream *ss, char *chars, int len)
+{
+    static char newline = '\n';
+    char *end = E.map.data + E.map.len;
+    if(E.map.data && chars >= E.map.data && chars + len < end && chars[len] == '\n') {
+        save_push(ss, chars, len + 1);
+    } else {
+        save_push(ss, chars, len);
+        save_push(ss, &newline, 1);
+    }
+}
+
+//write the snapshot to fd, lines that were never loaded are taken straight from the mapping.
+//returns the number of bytes written, or -1
+ssize_t editor_save_write(int fd, struct save_job *job)
+{
+    struct save_stream ss;
+    ss.fd = fd;
+    ss.n = 0;
+    ss.bytes = 0;
+    ss.failed = 0;
+    ss.job = job;
+
+    int i, j, len;
+    for(i = 0; i < job->npieces && !ss.failed; i++) {
+        struct row_piece *p = &job->pieces[i];
+        if(p->count == 0) {
+            save_push_line(&ss, p->chars, p->size);
+            continue;
+        }
+        for(j = 0; j < p->count; j++) {
+            char *chars = editor_map_line(p->line + j, &len);
+            save_push_line(&ss, chars, len);
+        }
+    }
+    save_flush(&ss);
+    return ss.failed ? -1 : (ssize_t)ss.bytes;
+}
+
+//make the file a save is written to, next to path and with the owner and permissions of the
+//file there. returns its descriptor, -1 on error, or -2 when path is to be written in place
+//instead: the directory can't be written to, the file has other links, which would keep the
+//old text, or it has an owner the new file can't be given. extended attributes and ACLs
+//aren't carried over
+int editor_save_open(char *path, struct save_job *job)
+{
+    struct stat st;
+    bool exists = stat(path, &st) == 0;
+    if(exists && st.st_nlink > 1) return -2;
+
+    char *tmp = malloc(strlen(path) + 16);
+    if(tmp == NULL) die("malloc");
+    sprintf(tmp, "%s.kiloXXXXXX", path);
+    int fd = mkstemp(tmp);
+    if(fd == -1) {
+        free(tmp);
+        return errno == EACCES || errno == EPERM || errno == EROFS ? -2 : -1;
+    }
+
+    //the new file gets the permissions of the old one, or those a new file got before
+    mode_t mask = umask(0);
+    umask(mask);
+    int ret = fd;
+    if(exists && (st.st_uid != geteuid() || st.st_gid != getegid()) && fchown(fd, st.st_uid, st.st_gid) == -1)
+        ret = -2;
+    else if(fchmod(fd, exists ? st.st_mode & 07777 : 0644 & ~mask) == -1)
+        ret = -1;
+    if(ret != fd) {
+        int saved_errno = errno;
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        errno = saved_errno;
+        return ret;
+    }
+    job->tmp = tmp;
+    return fd;
+}
+
+//write the snapshot to the file editor_save_open made and move it over path once it's safely
+//on disk, so a crash leaves either the old file or the new one. returns the bytes written, or -1
+ssize_t editor_write_file(char *path, struct save_job *job)
+{
+    int fd = job->fd;
+    char *tmp = job->tmp;
+    ssize_t len = editor_save_write(fd, job);
+    if(len == -1 || fsync(fd) == -1) len = -1;
+    if(close(fd) == -1) len = -1;
+    if(len == -1 || rename(tmp, path) == -1) {
+        int saved_errno = errno;
+        unlink(tmp);
+        len = -1;
+        errno = saved_errno;
+    }
+    pthread_mutex_lock(&job->lock);
+    job->tmp = NULL;
+    pthread_mutex_unlock(&job->lock);
+    free(tmp);
+    if(len == -1) return -1;
+
+    //the rename itself is only durable once the directory is
+    char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if(dfd != -1) {
+        fsync(dfd);
+        close(dfd);
+    }
+    free(dir);
+    return len;
+}
+
+//exiting in the middle of a save, by die() or otherwise, doesn't wait for it, the file it
+//was writing is removed instead so it isn't left next to the one being saved
+void editor_save_abandon()
+{
+    struct save_job *job = &E.save;
+    if(!job->running) return;
+    pthread_mutex_lock(&job->lock);
+    if(job->tmp) unlink(job->tmp);
+    pthread_mutex_unlock(&job->lock);
+}
+
+void *editor_save_run(void *arg)
+{
+    TRACE_THREAD("save");
+    TRACE_SCOPE("editor_save_run");
+    struct save_job *job = arg;
+    ssize_t len = editor_write_file(job->path, job);
+    int err = errno;
+    pthread_mutex_lock(&job->lock);
+    job->result = len;
+    job->err = err;
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+bool editor_row_frozen(erow *row)
+{
+    return E.save.running && row->frozen == E.save.gen;
+}
+
+//keep text a save is writing out until it's done, instead of freeing it
+void editor_save_retire(char *chars)
+{
+    struct save_job *job = &E.save;
+    if(job->nretired == job->retired_cap) {
+        job->retired_cap = job->retired_cap ? job->retired_cap * 2 : 16;
+        job->retired = realloc(job->retired, sizeof(char *) * job->retired_cap);
+        if(job->retired == NULL) die("realloc");
+    }
+    job->retired[job->nretired++] = chars;
+}
+
+void editor_save_add_piece(int line, int count, char *chars, int size)
+{
+    struct save_job *job = &E.save;
+    if(job->npieces == job->cap) {
+        job->cap = job->cap ? job->cap * 2 : 256;
+        job->pieces = realloc(job->pieces, sizeof(struct row_piece) * job->cap);
+        if(job->pieces == NULL) die("realloc");
+    }
+    struct row_piece *p = &job->pieces[job->npieces++];
+    p->row = 0;
+    p->line = line;
+    p->count = count;
+    p->chars = chars;
+    p->size = size;
+}
+
+//the rows as they are now: one piece per run of unloaded lines and per loaded row,
+//the text of the loaded rows is frozen until the save is over
+void editor_save_snapshot()
+{
+    struct save_job *job = &E.save;
+    job->npieces = 0;
+    job->total = 0;
+    job->gen++;
+    row_node *n;
+    for(n = row_node_first(); n; n = row_node_next(n)) {
+        if(!n->span) {
+            editor_save_add_piece(0, 0, n->row.chars, n->row.size);
+            if(!n->row.mapped) n->row.frozen = job->gen;
+            job->total += n->row.size + 1;
+        } else {
+            editor_save_add_piece(n->line, n->span, NULL, 0);
+            size_t start = n->line ? E.map.eol[n->line - 1] + 1 : 0;
+            job->total += E.map.eol[n->line + n->span - 1] - start + 1;
+        }
+    }
+}
+
+//pick up the result of the save once its thread is done, or wait for it to be
+void editor_save_finish(bool wait)
+{
+    struct save_job *job = &E.save;
+    if(!job->running) return;
+    pthread_mutex_lock(&job->lock);
+    bool done = job->done;
+    pthread_mutex_unlock(&job->lock);
+    if(!done && !wait) return;
+
+    if(job->threaded) pthread_join(job->thread, NULL);
+    pthread_mutex_destroy(&job->lock);
+    job->running = 0;
+    for(int i = 0; i < job->nretired; i++)
+        free(job->retired[i]);
+    job->nretired = 0;
+
+    if(job->result != -1) {
+        //the rows are rebuilt from the new file, which lets go of the old one. that's only
+        //possible when nothing was edited meanwhile, otherwise the rows still refer to the
+        //lines of the old mapping, which stays. it holds the same text anyway. a search
+        //going on is counting over the rows, so they're left alone then too
+        if(E.dirty == job->dirty && E.map.data && E.matches.query == NULL) {
+            struct stat st;
+            char *data = editor_map_file(job->path, &st);
+            if(data || job->result == 0) {
+                editor_map_close();
+                if(data) {
+                    editor_map_set(data, st.st_size, 0);
+                    E.map.st = st;
+                }
+            }
+        }
+        //edits made while saving aren't in the file
+        E.dirty -= job->dirty;
+        editor_set_status_message("%zd bytes written to disk", job->result);
+    } else {
+        editor_set_status_message("Can't save! I/O error: %s", strerror(job->err));
+    }
+    free(job->path);
+    job->path = NULL;
+}
+
+//let the save run while no key is waiting, redrawing so its progress shows
+void editor_save_idle()
+{
+    editor_save_finish(0);
+    while(E.save.running && !editor_input_pending(100)) {
+        editor_save_finish(0);
+        editor_refresh_screen();
+    }
+}
+
+//how far the save has got, in percent
+int editor_save_progress()
+{
+    struct save_job *job = &E.save;
+    pthread_mutex_lock(&job->lock);
+    size_t written = job->written;
+    pthread_mutex_unlock(&job->lock);
+    if(job->total == 0 || written >= job->total) return 100;
+    return written * 100 / job->total;
+}
+
+//write out all n bytes of buf at offset of fd, carrying on after short writes and interruptions
+int save_pwrite(int fd, const char *buf, size_t n, off_t offset)
+{
+    while(n > 0) {
+        ssize_t w = pwrite(fd, buf, n, offset);
+        if(w == -1) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        buf += w;
+        n -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+//when the rows before the first edit are still the file on disk, only what follows them is
+//written, over the old text, and the file is cut to its new length. returns the length of
+//the file, -1 if writing failed, or -2 when the file has to be saved whole: it isn't the
+//one mapped anymore, or the edit isn't in the last small part of a big file. a crash while
+//writing in place leaves the file cut short, which saving it whole never does. a file with
+//\r\n line breaks is saved whole too, the lines kept would still have them and the rest not.
+//with whole, all of it is written over the file, for when it can't be replaced by a new one
+ssize_t editor_save_in_place(char *path, bool whole)
+{
+    int at = whole ? 0 : E.edit_from;
+    struct stat st;
+    if(!whole && (E.map.data == NULL || E.map.heap || E.map.cr || at == INT_MAX || stat(path, &st) == -1 ||
+       st.st_dev != E.map.st.st_dev || st.st_ino != E.map.st.st_ino || st.st_size != E.map.st.st_size ||
+       st.st_mtim.tv_sec != E.map.st.st_mtim.tv_sec || st.st_mtim.tv_nsec != E.map.st.st_mtim.tv_nsec))
+        return -2;
+    if(at > E.numrows) at = E.numrows;
+
+    //the rows above the edit are the first lines of the file, which stay as they are. if the
+    //last of them had no newline, it gets one now
+    size_t offset = 0;
+    bool newline = 0;
+    if(at > 0) {
+        offset = E.map.eol[at - 1];
+        if(offset < E.map.len) offset++;
+        else newline = 1;
+    }
+    if(!whole && offset < SAVE_IN_PLACE_MIN) return -2;
+    size_t limit = whole ? SIZE_MAX : E.map.len / SAVE_IN_PLACE_SHARE;
+    if(limit > SAVE_IN_PLACE_MAX && !whole) limit = SAVE_IN_PLACE_MAX;
+
+    //what follows is gathered first, much of it may be read from where it's going to be written
+    int off = 0, j, len;
+    row_node *first = at < E.numrows ? row_node_at(at, &off) : NULL;
+    row_node *n;
+    size_t size = newline;
+    for(n = first; n && size <= limit; n = row_node_next(n)) {
+        if(!n->span) {
+            size += n->row.size + 1;
+        } else {
+            int line = n->line + (n == first ? off : 0);
+            size_t start = line ? E.map.eol[line - 1] + 1 : 0;
+            size += E.map.eol[n->line + n->span - 1] - start + 1;
+        }
+    }
+    if(size > limit) return -2;
+
+    char *buf = malloc(size ? size : 1);
+    if(buf == NULL) die("malloc");
+    char *p = buf;
+    if(newline) *p++ = '\n';
+    for(n = first; n; n = row_node_next(n)) {
+        for(j = n == first ? off : 0; j < row_node_lines(n); j++) {
+            char *chars = n->row.chars;
+            len = n->row.size;
+            if(n->span) chars = editor_map_line(n->line + j, &len);
+            memcpy(p, chars, len);
+            p += len;
+            *p++ = '\n';
+        }
+    }
+    size = p - buf;
+
+    //nothing may read the mapping while the file under it changes
+    editor_hl_worker_stop();
+    editor_search_cancel();
+    bool ok = 0;
+    int fd = open(path, whole ? O_WRONLY | O_CREAT : O_WRONLY, 0644);
+    if(fd != -1) {
+        ok = save_pwrite(fd, buf, size, offset) == 0 && ftruncate(fd, offset + size) == 0 && fsync(fd) == 0;
+        if(close(fd) == -1) ok = 0;
+    }
+    int saved_errno = errno;
+
+    //the rows are rebuilt from the file. if it couldn't be written, from the lines above the
+    //edit, which the write didn't reach, and buf
+    if(ok) {
+        editor_map_close();
+        if(offset + size) editor_map_open(path);
+    } else {
+        char *text = malloc(offset + size ? offset + size : 1);
+        if(text == NULL) die("malloc");
+        if(offset) memcpy(text, E.map.data, offset);
+        memcpy(text + offset, buf, size);
+        editor_map_close();
+        if(offset + size) editor_map_set(text, offset + size, 1);
+        else free(text);
+    }
+    free(buf);
+    errno = saved_errno;
+    return ok ? (ssize_t)(offset + size) : -1;
+}
+
+void editor_open(char *filename) 
+{
+    TRACE_SCOPE("editor_open");
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editor_select_syntax_highlight();
+
+    if(editor_map_open(filename) == 0) {
+        E.dirty = 0;
+        return;
+    }
+
+    FILE *fp = fopen(filename, "r");
+    if(!fp) die("fopen");
+
+    char *line = NULL;
+    //size_t: unsigned int(32)/unsigned long(64)
+    //ssize_t: int(32)/long (64)
+    size_t linecap = 0;
+    ssize_t linelen;
+    while((linelen = getline(&line, &linecap, fp)) != -1) {
+        //strip off return carriage
+        while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            linelen--;
+        editor_insert_row(E.numrows, line, linelen, 0); // no auto indent needed
+    }
+    if(E.options & ENABLE_LINE_NUM) {
+        editor_update_row_offset();
+    }
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+    E.edit_from = INT_MAX;
+}
+
+void editor_save() 
+{
+    TRACE_SCOPE("editor_save");
+    if(E.save.running) {
+        editor_set_status_message("Still saving, %d%% written", editor_save_progress());
+        return;
+    }
+    if(E.filename == NULL) {
+        E.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
+        if(E.filename == NULL) {
+            editor_set_status_message("Save aborted");
+            return;
+        }
+        editor_select_syntax_highlight();
+    }
+
+    editor_map_index_all();
+
+    //a symlink is followed, so the file it points to is the one replaced
+    struct save_job *job = &E.save;
+    job->path = realpath(E.filename, NULL);
+    if(job->path == NULL) job->path = strdup(E.filename);
+
+    //an edit near the end of a big file only needs the end of the file rewritten. it can't
+    //be undone if the write fails halfway through, so it's kept for small tails of big files
+    ssize_t len = editor_save_in_place(job->path, 0);
+    int fd = -1;
+    if(len == -2) {
+        //otherwise a new file replaces the old one, or when that would lose something of the
+        //old file, or can't be made at all, the old file is written over
+        fd = editor_save_open(job->path, job);
+        if(fd == -2) len = editor_save_in_place(job->path, 1);
+        else if(fd == -1) len = -1;
+    }
+    if(len != -2) {
+        if(len != -1) {
+            editor_set_status_message("%zd bytes written to disk", len);
+            E.dirty = 0;
+        } else {
+            editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+        }
+        free(job->path);
+        job->path = NULL;
+        return;
+    }
+
+    //the old file is only replaced, never written to, so the mapping stays valid while the
+    //thread writes out the snapshot and editing goes on
+    editor_save_snapshot();
+    job->dirty = E.dirty;
+    job->written = 0;
+    job->done = 0;
+    job->fd = fd;
+    job->running = 1;
+    pthread_mutex_init(&job->lock, NULL);
+    job->threaded = pthread_create(&job->thread, NULL, editor_save_run, job) == 0;
+    //without the thread the file is written right away, as it always was
+    if(!job->threaded) {
+        editor_save_run(job);
+        editor_save_finish(1);
+    }
+}
+
+/*** search ***/
+
+//the shift table of Horspool's algorithm, how far the window may move when its byte at the
+//far end (the last one going forwards, the first one going backwards) is c
+void search_shifts(const char *needle, size_t m, int direction, size_t *shift)
+{
+    size_t i;
+    for(i = 0; i < 256; i++) shift[i] = m;
+    if(direction == 1) {
+        for(i = 0; i + 1 < m; i++) shift[(unsigned char)needle[i]] = m - 1 - i;
+    } else {
+        for(i = m - 1; i > 0; i--) shift[(unsigned char)needle[i]] = i;
+    }
+}
+
+char *search_horspool_forward(const char *hay, size_t n, const char *needle, size_t m)
+{
+    size_t shift[256];
+    search_shifts(needle, m, 1, shift);
+    size_t i = 0;
+    while(i + m <= n) {
+        unsigned char last = hay[i + m - 1];
+        if(last == (unsigned char)needle[m - 1] && !memcmp(hay + i, needle, m - 1))
+            return (char *)hay + i;
+        i += shift[last];
+    }
+    return NULL;
+}
+
+char *search_horspool_backward(const char *hay, size_t n, const char *needle, size_t m)
+{
+    size_t shift[256];
+    search_shifts(needle, m, -1, shift);
+    size_t i = n - m;  //start of the window
+    for(;;) {
+        unsigned char first = hay[i];
+        if(first == (unsigned char)needle[0] && !memcmp(hay + i + 1, needle + 1, m - 1))
+            return (char *)hay + i;
+        if(i < shift[first]) return NULL;
+        i -= shift[first];
+    }
+}
+
+//first occurrence of needle in the n bytes of hay. memchr, which the libc vectorizes, jumps
+//between bytes equal to the first of needle, and the last byte is compared before the rest.
+//when the first byte is too common for that to pay off, the rest is left to Horspool
+char *search_forward(const char *hay, size_t n, const char *needle, size_t m)
+{
+    if(m == 0) return (char *)hay;
+    if(m > n) return NULL;
+    if(m == 1) return memchr(hay, needle[0], n);
+
+    const char *p = hay, *last = hay + n - m;
+    int false_hits = 0;
+    while(p <= last) {
+        p = memchr(p, needle[0], last - p + 1);
+        if(p == NULL) return NULL;
+        if(p[m - 1] == needle[m - 1] && !memcmp(p + 1, needle + 1, m - 2))
+            return (char *)p;
+        p++;
+        if(++false_hits > SEARCH_FALSE_HITS && m > 2)
+            return search_horspool_forward(p, hay + n - p, needle, m);
+    }
+    return NULL;
+}
+
+//last occurrence of needle in the n bytes of hay, the mirror image of search_forward using memrchr
+char *search_backward(const char *hay, size_t n, const char *needle, size_t m)
+{
+    if(m == 0) return (char *)hay + n;
+    if(m > n) return NULL;
+    if(m == 1) return memrchr(hay, needle[0], n);
+
+    size_t starts = n - m + 1;  //candidates are hay[0] to hay[starts - 1]
+    int false_hits = 0;
+    while(starts > 0) {
+        const char *p = memrchr(hay, needle[0], starts);
+        if(p == NULL) return NULL;
+        if(p[m - 1] == needle[m - 1] && !memcmp(p + 1, needle + 1, m - 2))
+            return (char *)p;
+        starts = p - hay;
+        if(++false_hits > SEARCH_FALSE_HITS && m > 2 && starts > 0)
+            return search_horspool_backward(hay, starts + m - 1, needle, m);
+    }
+    return NULL;
+}
+
+/*** regex ***/
+
+void regex_set_add(unsigned int *set, int c)
+{
+    set[c / 32] |= 1u << (c % 32);
+}
+
+bool regex_set_has(const unsigned int *set, int c)
+{
+    return (set[c / 32] >> (c % 32)) & 1;
+}
+
+//add the bytes of the class \d, \w or \s to set, the capital letters stand for everything else.
+//returns 0 if c doesn't name a class
+bool regex_set_escape(unsigned int *set, int c)
+{
+    int lower = tolower(c);
+    if(lower != 'd' && lower != 'w' && lower != 's') return 0;
+    for(int b = 0; b < 256; b++) {
+        bool in = lower == 'd' ? isdigit(b) != 0 : lower == 'w' ? (isalnum(b) || b == '_') : isspace(b) != 0;
+        if(in != (c != lower)) regex_set_add(set, b);
+    }
+    return 1;
+}
+
+//the byte an escaped character stands for, \t is a tab and anything else is itself
+int regex_escape_byte(int c)
+{
+    return c == 't' ? '\t' : c;
+}
+
+int regex_node_new(struct regex *re, int op, int a, int b)
+{
+    if(re->nnodes == re->cap) {
+        re->cap = re->cap ? re->cap * 2 : 32;
+        re->nodes = realloc(re->nodes, sizeof(struct regex_node) * re->cap);
+        if(re->nodes == NULL) die("realloc");
+    }
+    struct regex_node *n = &re->nodes[re->nnodes];
+    memset(n, 0, sizeof(*n));
+    n->op = op;
+    n->a = a;
+    n->b = b;
+    return re->nnodes++;
+}
+
+//the parser works through *p, each function returns the node it parsed or -1 on a syntax error
+
+int regex_parse_alt(struct regex *re, const char **p, const char *end);
+
+//[abc], [a-z] or [^...], *p is past the [
+int regex_parse_class(struct regex *re, const char **p, const char *end)
+{
+    unsigned int set[RE_SET_WORDS] = {0};
+    bool negate = 0;
+    if(*p < end && **p == '^') {
+        negate = 1;
+        (*p)++;
+    }
+    //a ] right at the start is taken literally
+    bool first = 1;
+    while(*p < end && (**p != ']' || first)) {
+        first = 0;
+        int c = (unsigned char)*(*p)++;
+        if(c == '\\') {
+            if(*p == end) return -1;
+            c = (unsigned char)*(*p)++;
+            if(regex_set_escape(set, c)) continue;
+            c = regex_escape_byte(c);
+        }
+        int hi = c;
+        if(*p + 1 < end && **p == '-' && (*p)[1] != ']') {
+            hi = (unsigned char)(*p)[1];
+            *p += 2;
+            if(hi == '\\') {
+                if(*p == end) return -1;
+                hi = regex_escape_byte((unsigned char)*(*p)++);
+            }
+        }
+        for(; c <= hi; c++) regex_set_add(set, c);
+    }
+    if(*p == end) return -1;
+    (*p)++;
+
+    int node = regex_node_new(re, RE_SET, -1, -1);
+    for(int b = 0; b < 256; b++)
+        if(regex_set_has(set, b) != negate) regex_set_add(re->nodes[node].set, b);
+    return node;
+}
+
+int regex_parse_atom(struct regex *re, const char **p, const char *end)
+{
+    int c = (unsigned char)*(*p)++;
+    if(c == '(') {
+        int node = regex_parse_alt(re, p, end);
+        if(node < 0 || *p == end || **p != ')') return -1;
+        (*p)++;
+        return node;
+    }
+    if(c == '[') return regex_parse_class(re, p, end);
+    //a repeat with nothing to repeat
+    if(c == '*' || c == '+' || c == '?') return -1;
+
+    int node = regex_node_new(re, RE_SET, -1, -1);
+    unsigned int *set = re->nodes[node].set;
+    if(c == '.') {
+        for(int b = 0; b < 256; b++) regex_set_add(set, b);
+    } else if(c == '^') {
+        regex_set_add(set, RE_BOL);
+    } else if(c == '$') {
+        regex_set_add(set, RE_EOL);
+    } else if(c == '\\') {
+        if(*p == end) return -1;
+        c = (unsigned char)*(*p)++;
+        if(!regex_set_escape(set, c)) regex_set_add(set, regex_escape_byte(c));
+    } else {
+        regex_set_add(set, c);
+    }
+    return node;
+}
+
+int regex_parse_repeat(struct regex *re, const char **p, const char *end)
+{
+    int node = regex_parse_atom(re, p, end);
+    while(node >= 0 && *p < end && (**p == '*' || **p == '+' || **p == '?')) {
+        int op = **p == '*' ? RE_STAR : **p == '+' ? RE_PLUS : RE_QUEST;
+        (*p)++;
+        node = regex_node_new(re, op, node, -1);
+    }
+    return node;
+}
+
+int regex_parse_cat(struct regex *re, const char **p, const char *end)
+{
+    int node = -1;
+    while(*p < end && **p != '|' && **p != ')') {
+        int next = regex_parse_repeat(re, p, end);
+        if(next < 0) return -1;
+        node = node < 0 ? next : regex_node_new(re, RE_CAT, node, next);
+    }
+    return node < 0 ? regex_node_new(re, RE_EMPTY, -1, -1) : node;
+}
+
+int regex_parse_alt(struct regex *re, const char **p, const char *end)
+{
+    int node = regex_parse_cat(re, p, end);
+    while(node >= 0 && *p < end && **p == '|') {
+        (*p)++;
+        int next = regex_parse_cat(re, p, end);
+        node = next < 0 ? -1 : regex_node_new(re, RE_ALT, node, next);
+    }
+    return node;
+}
+
+int regex_nfa_state(struct regex_nfa *nfa, int kind, int out, int out1)
+{
+    if(nfa->n == nfa->cap) {
+        nfa->cap = nfa->cap ? nfa->cap * 2 : 32;
+        nfa->s = realloc(nfa->s, sizeof(struct regex_state) * nfa->cap);
+        if(nfa->s == NULL) die("realloc");
+    }
+    struct regex_state *s = &nfa->s[nfa->n];
+    memset(s, 0, sizeof(*s));
+    s->kind = kind;
+    s->out = out;
+    s->out1 = out1;
+    return nfa->n++;
+}
+
+//add the states reading node to nfa, going on to next after it, returns the first of them.
+//backwards, the parts of a concatenation are read last to first
+int regex_nfa_build(struct regex *re, struct regex_nfa *nfa, int node, int next, bool backwards)
+{
+    struct regex_node *n = &re->nodes[node];
+    int s, body;
+    switch(n->op) {
+        case RE_SET:
+            s = regex_nfa_state(nfa, RE_READ, next, -1);
+            memcpy(nfa->s[s].set, n->set, sizeof(n->set));
+            return s;
+        case RE_CAT:
+            if(backwards)
+                return regex_nfa_build(re, nfa, n->b, regex_nfa_build(re, nfa, n->a, next, backwards), backwards);
+            return regex_nfa_build(re, nfa, n->a, regex_nfa_build(re, nfa, n->b, next, backwards), backwards);
+        case RE_ALT:
+            s = regex_nfa_build(re, nfa, n->a, next, backwards);
+            return regex_nfa_state(nfa, RE_SPLIT, s, regex_nfa_build(re, nfa, n->b, next, backwards));
+        case RE_QUEST:
+            return regex_nfa_state(nfa, RE_SPLIT, regex_nfa_build(re, nfa, n->a, next, backwards), next);
+        case RE_STAR:
+        case RE_PLUS:
+            s = regex_nfa_state(nfa, RE_SPLIT, -1, next);
+            body = regex_nfa_build(re, nfa, n->a, s, backwards);
+            nfa->s[s].out = body;
+            return n->op == RE_STAR ? s : body;
+    }
+    return next;  //RE_EMPTY
+}
+
+//the parts of the concatenation node is, in order
+void regex_cat_parts(struct regex *re, int node, int *parts, int *n)
+{
+    if(re->nodes[node].op == RE_CAT) {
+        regex_cat_parts(re, re->nodes[node].a, parts, n);
+        regex_cat_parts(re, re->nodes[node].b, parts, n);
+    } else {
+        parts[(*n)++] = node;
+    }
+}
+
+//the text every match contains: the longest run of single bytes the pattern reads one after
+//the other at its top level. ^ and $ read no bytes and don't break a run, spaces do, since the
+//mapped text may still have tabs where the render has spaces
+void regex_literal(struct regex *re, int root)
+{
+    int *parts = malloc(sizeof(int) * re->nnodes);
+    char *run = malloc(re->nnodes + 1);
+    re->lit = malloc(re->nnodes + 1);
+    if(parts == NULL || run == NULL || re->lit == NULL) die("malloc");
+    re->litlen = 0;
+
+    int nparts = 0, len = 0, i, b;
+    regex_cat_parts(re, root, parts, &nparts);
+    for(i = 0; i <= nparts; i++) {
+        int c = -1, count = 0;
+        if(i < nparts && re->nodes[parts[i]].op == RE_SET) {
+            unsigned int *set = re->nodes[parts[i]].set;
+            for(b = 0; b < 256; b++) {
+                if(regex_set_has(set, b)) {
+                    c = b;
+                    count++;
+                }
+            }
+            if(count == 0) continue;
+            if(count > 1) c = -1;
+        }
+        if(c >= 0 && c != ' ') {
+            run[len++] = c;
+            continue;
+        }
+        if(len > re->litlen) {
+            memcpy(re->lit, run, len);
+            re->litlen = len;
+        }
+        len = 0;
+    }
+    free(parts);
+    free(run);
+}
+
+void regex_free(struct regex *re)
+{
+    if(re == NULL) return;
+    free(re->nodes);
+    free(re->fwd.s);
+    free(re->rev.s);
+    free(re->lit);
+    free(re);
+}
+
+//compile the len bytes of pattern, NULL if they aren't a valid regex. the syntax is . [] ()
+//| * + ? ^ $ with \d \w \s and their capitals, and \ in front of anything else takes it literally
+struct regex *regex_compile(const char *pattern, int len)
+{
+    struct regex *re = calloc(1, sizeof(struct regex));
+    if(re == NULL) die("calloc");
+    const char *p = pattern, *end = pattern + len;
+    int root = regex_parse_alt(re, &p, end);
+    if(root < 0 || p != end) {
+        regex_free(re);
+        return NULL;
+    }
+    re->fwd.start = regex_nfa_build(re, &re->fwd, root, regex_nfa_state(&re->fwd, RE_MATCH, -1, -1), 0);
+    re->rev.start = regex_nfa_build(re, &re->rev, root, regex_nfa_state(&re->rev, RE_MATCH, -1, -1), 1);
+    regex_literal(re, root);
+    return re;
+}
+
+//forget every state, the next step builds them again
+void regex_dfa_flush(struct regex_dfa *d)
+{
+    d->n = 0;
+    d->pooln = 0;
+    for(int i = 0; i < 2 * RE_DFA_STATES; i++) d->hash[i] = -1;
+    d->start[0] = d->start[1] = -1;
+}
+
+void regex_dfa_init(struct regex_dfa *d, struct regex_nfa *nfa, bool unanchored)
+{
+    memset(d, 0, sizeof(*d));
+    d->nfa = nfa;
+    d->unanchored = unanchored;
+    d->hash = malloc(sizeof(int) * 2 * RE_DFA_STATES);
+    d->work = malloc(sizeof(int) * nfa->n);
+    d->mark = calloc(nfa->n, sizeof(unsigned int));
+    if(d->hash == NULL || d->work == NULL || d->mark == NULL) die("malloc");
+    regex_dfa_flush(d);
+}
+
+void regex_dfa_free(struct regex_dfa *d)
+{
+    free(d->next);
+    free(d->accept);
+    free(d->off);
+    free(d->size);
+    free(d->pool);
+    free(d->hash);
+    free(d->work);
+    free(d->mark);
+}
+
+//put NFA state s on the work list, and every state it reaches without reading
+void regex_dfa_closure(struct regex_dfa *d, int s)
+{
+    if(s < 0 || d->mark[s] == d->gen) return;
+    d->mark[s] = d->gen;
+    struct regex_state *st = &d->nfa->s[s];
+    if(st->kind == RE_SPLIT) {
+        regex_dfa_closure(d, st->out);
+        regex_dfa_closure(d, st->out1);
+    } else {
+        d->work[d->nwork++] = s;
+    }
+}
+
+int regex_int_compare(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+unsigned int regex_dfa_hash(const int *set, int n)
+{
+    unsigned int h = 2166136261u;
+    for(int i = 0; i < n; i++) h = (h ^ set[i]) * 16777619u;
+    return h;
+}
+
+//the state made of the NFA states on the work list, added if it's new
+int regex_dfa_add(struct regex_dfa *d)
+{
+    int *set = d->work, n = d->nwork, i;
+    qsort(set, n, sizeof(int), regex_int_compare);
+    unsigned int mask = 2 * RE_DFA_STATES - 1;
+    unsigned int h = regex_dfa_hash(set, n) & mask;
+    for(; d->hash[h] != -1; h = (h + 1) & mask) {
+        int s = d->hash[h];
+        if(d->size[s] == n && !memcmp(&d->pool[d->off[s]], set, sizeof(int) * n)) return s;
+    }
+    if(d->n == RE_DFA_STATES) {
+        regex_dfa_flush(d);
+        h = regex_dfa_hash(set, n) & mask;
+    }
+
+    if(d->n == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->next = realloc(d->next, sizeof(int) * RE_SYMBOLS * d->cap);
+        d->accept = realloc(d->accept, sizeof(bool) * d->cap);
+        d->off = realloc(d->off, sizeof(int) * d->cap);
+        d->size = realloc(d->size, sizeof(int) * d->cap);
+        if(d->next == NULL || d->accept == NULL || d->off == NULL || d->size == NULL) die("realloc");
+    }
+    if(d->pooln + n > d->poolcap) {
+        while(d->pooln + n > d->poolcap) d->poolcap = d->poolcap ? d->poolcap * 2 : 256;
+        d->pool = realloc(d->pool, sizeof(int) * d->poolcap);
+        if(d->pool == NULL) die("realloc");
+    }
+
+    int s = d->n++;
+    memcpy(&d->pool[d->pooln], set, sizeof(int) * n);
+    d->off[s] = d->pooln;
+    d->size[s] = n;
+    d->pooln += n;
+    d->accept[s] = 0;
+    for(i = 0; i < n; i++)
+        if(d->nfa->s[set[i]].kind == RE_MATCH) d->accept[s] = 1;
+    memset(&d->next[s * RE_SYMBOLS], 0xff, sizeof(int) * RE_SYMBOLS);
+    d->hash[h] = s;
+    return s;
+}
+
+//the state after reading symbol c in state s, worked out from the NFA the first time
+int regex_dfa_step(struct regex_dfa *d, int s, int c)
+{
+    struct regex_state *st = d->nfa->s;
+    d->gen++;
+    d->nwork = 0;
+    for(int i = 0; i < d->size[s]; i++) {
+        int ns = d->pool[d->off[s] + i];
+        if(st[ns].kind == RE_READ && regex_set_has(st[ns].set, c))
+            regex_dfa_closure(d, st[ns].out);
+    }
+    if(d->unanchored) regex_dfa_closure(d, d->nfa->start);
+
+    int n = d->n;
+    int t = regex_dfa_add(d);
+    //unless the states were just forgotten, s is still there to remember the way
+    if(d->n >= n) d->next[s * RE_SYMBOLS + c] = t;
+    return t;
+}
+
+int regex_dfa_next(struct regex_dfa *d, int s, int c)
+{
+    int t = d->next[s * RE_SYMBOLS + c];
+    return t >= 0 ? t : regex_dfa_step(d, s, c);
+}
+
+//the state before reading anything, at_bol lets the NFA read the start of the line as well
+int regex_dfa_start(struct regex_dfa *d, bool at_bol)
+{
+    if(d->start[at_bol] >= 0) return d->start[at_bol];
+    struct regex_state *st = d->nfa->s;
+    d->gen++;
+    d->nwork = 0;
+    regex_dfa_closure(d, d->nfa->start);
+    if(at_bol) {
+        int n = d->nwork;
+        for(int i = 0; i < n; i++)
+            if(st[d->work[i]].kind == RE_READ && regex_set_has(st[d->work[i]].set, RE_BOL))
+                regex_dfa_closure(d, st[d->work[i]].out);
+    }
+    int s = regex_dfa_add(d);
+    d->start[at_bol] = s;
+    return s;
+}
+
+struct regex_match *regex_match_new(struct regex *re)
+{
+    struct regex_match *m = calloc(1, sizeof(struct regex_match));
+    if(m == NULL) die("calloc");
+    m->re = re;
+    regex_dfa_init(&m->fwd, &re->fwd, 0);
+    regex_dfa_init(&m->rev, &re->rev, 1);
+    return m;
+}
+
+void regex_match_free(struct regex_match *m)
+{
+    if(m == NULL) return;
+    regex_dfa_free(&m->fwd);
+    regex_dfa_free(&m->rev);
+    free(m->starts);
+    free(m);
+}
+
+//mark in m->starts every byte from from on where a match of the n bytes of text starts,
+//reading the text backwards once. returns 0 if no match starts there
+bool regex_mark_starts(struct regex_match *m, const char *text, int n, int from)
+{
+    struct regex *re = m->re;
+    if(from >= n) return 0;
+    //text without the literal can't match
+    if(re->litlen && search_forward(text + from, n - from, re->lit, re->litlen) == NULL) return 0;
+
+    if(n + 1 > m->cap) {
+        m->cap = n + 1;
+        m->starts = realloc(m->starts, m->cap);
+        if(m->starts == NULL) die("realloc");
+    }
+    struct regex_dfa *d = &m->rev;
+    int s = regex_dfa_next(d, regex_dfa_start(d, 0), RE_EOL);
+    bool any = 0;
+    for(int i = n - 1; i >= from; i--) {
+        unsigned char c = text[i];
+        int t = d->next[s * RE_SYMBOLS + c];
+        s = t >= 0 ? t : regex_dfa_step(d, s, c);
+        m->starts[i] = d->accept[s];
+        any |= d->accept[s];
+    }
+    if(from == 0 && d->accept[regex_dfa_next(d, s, RE_BOL)]) {
+        m->starts[0] = 1;
+        any = 1;
+    }
+    return any;
+}
+
+//where the longest match starting at byte from of text ends, -1 if none does
+int regex_longest(struct regex_match *m, const char *text, int n, int from)
+{
+    struct regex_dfa *d = &m->fwd;
+    int s = regex_dfa_start(d, from == 0);
+    int end = d->accept[s] ? from : -1;
+    for(int i = from; i < n; i++) {
+        unsigned char c = text[i];
+        int t = d->next[s * RE_SYMBOLS + c];
+        s = t >= 0 ? t : regex_dfa_step(d, s, c);
+        if(d->accept[s]) end = i + 1;
+        else if(d->size[s] == 0) return end;  //no NFA state is left, nothing longer can match
+    }
+    if(d->accept[regex_dfa_next(d, s, RE_EOL)]) end = n;
+    return end;
+}
+
+//the first match that isn't empty starting at or after from, its length goes in *len.
+//-1 if there is none. the starts must have been marked from at most from on
+int regex_next(struct regex_match *m, const char *text, int n, int from, int *len)
+{
+    while(from < n) {
+        unsigned char *p = memchr(m->starts + from, 1, n - from);
+        if(p == NULL) return -1;
+        int at = p - m->starts;
+        int end = regex_longest(m, text, n, at);
+        if(end > at) {
+            *len = end - at;
+            return at;
+        }
+        from = at + 1;
+    }
+    return -1;
+}
+
+//the first match in the n bytes of text starting at or after from, -1 if there is none
+int regex_search(struct regex_match *m, const char *text, int n, int from, int *len)
+{
+    if(!regex_mark_starts(m, text, n, from)) return -1;
+    return regex_next(m, text, n, from, len);
+}
+
+/*** find ***/
+
+//the mapped line holding byte offset of the file
+int editor_map_line_of(size_t offset)
+{
+    int lo = 0, hi = E.map.nlines - 1;
+    while(lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if(E.map.eol[mid] < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
 }
 
-int editor_row_cx_to_rx(erow *row, int cx)
+//what to look for in the text to find the rows that may match query: the render has spaces
+//where the text has tabs, so only the longest piece of the query without spaces is sure to
+//show up in the text as it is. a regex has its literal for that. *m is 0 if there's nothing
+char *search_needle(char *query, int len, struct regex *re, int *m)
 {
-    int rx = 0;
-    int j;
-    for(j = 0; j < cx; j++) {
-        if(row->chars[j] == '\t')
-            rx += (E.KILO_TAB_STOP - 1) - (rx % E.KILO_TAB_STOP);
-        rx++;
+    if(re) {
+        *m = re->litlen;
+        return re->lit;
     }
-    return rx;
+    char *needle = query;
+    int i, j;
+    *m = 0;
+    for(i = 0; i < len; i = j + 1) {
+        for(j = i; j < len && query[j] != ' '; j++);
+        if(j - i > *m) {
+            needle = &query[i];
+            *m = j - i;
+        }
+    }
+    return needle;
 }
 
-int editor_row_rx_to_cx(erow *row, int rx)
+//how many rows from at on, going in direction, can't contain query. only rows that aren't
+//loaded yet are looked at, in the mapped text and without turning them into rows
+int editor_find_skip(int at, char *query, int len, int direction, int limit)
 {
-    int cur_rx = 0;
-    int cx;
-    for(cx = 0; cx < row->size; cx++) {
-        if(row->chars[cx] == '\t')
-            cur_rx += (E.KILO_TAB_STOP - 1) - (cur_rx % E.KILO_TAB_STOP);
-        cur_rx++;
-        if(cur_rx > rx) return cx;
+    int off;
+    row_node *n = row_node_at(at, &off);
+    if(n == NULL || !n->span) return 0;
+
+    int m;
+    char *needle = search_needle(query, len, E.matches.re, &m);
+    if(m == 0) return 0;
+
+    int first, count;
+    if(direction == 1) {
+        first = n->line + off;
+        count = n->span - off;
+        if(count > limit) count = limit;
+    } else {
+        count = off + 1;
+        if(count > limit) count = limit;
+        first = n->line + off - count + 1;
     }
-    return cx;
+    size_t start = first ? E.map.eol[first - 1] + 1 : 0;
+    size_t end = E.map.eol[first + count - 1];
+    char *hit = direction == 1 ? search_forward(E.map.data + start, end - start, needle, m) :
+                                 search_backward(E.map.data + start, end - start, needle, m);
+    if(hit == NULL) return count;
+    int line = editor_map_line_of(hit - E.map.data);
+    return direction == 1 ? line - first : first + count - 1 - line;
 }
 
-void editor_update_row(erow *row)
+//the render of row at, worked out without loading the row or highlighting it
+char *editor_find_render(int at, int *rsize)
 {
-    //update rsize and render field
-    int tabs = 0;
-    int j = 0;
-    for(j = 0; j < row->size; j++)
-        if(row->chars[j] == '\t') tabs++;
-    
-    free(row->render); //it's Ok to free a NULL pointer
-    row->render = malloc(row->size + tabs * (E.KILO_TAB_STOP - 1) + 1); //row->size already counts 1 for each tab
-
-    int idx = 0;
-    for(j = 0; j <row->size; j++) {
-        if(row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while(idx % E.KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-        } else 
-            row->render[idx++] = row->chars[j];
+    static char *buf = NULL;
+    static int cap = 0;
+
+    int off;
+    row_node *n = row_node_at(at, &off);
+    erow line, *row = &n->row;
+    if(n->span) {
+        memset(&line, 0, sizeof(line));
+        line.chars = editor_map_line(n->line + off, &line.size);
+        row = &line;
+    } else if(row->render && row->rcols == 0) {
+        *rsize = row->rsize;
+        return row->render;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-
-    editor_update_syntax(row);
+    //without tabs the render is the text itself
+    if(memchr(row->chars, '\t', row->size) == NULL) {
+        *rsize = row->size;
+        return row->chars;
+    }
+    *rsize = editor_row_expand(row, &buf, &cap);
+    return buf;
 }
 
-void editor_update_row_offset() {
-    E.screencols += (E.row_num_offset + 1);
-    E.row_num_offset = deciLength(E.numrows);
-    E.screencols -= (E.row_num_offset + 1);
+void editor_matches_push(int row, int rx, int len)
+{
+    struct match_set *ms = &E.matches;
+    if(ms->n == ms->cap) {
+        ms->cap = ms->cap ? ms->cap * 2 : 64;
+        ms->m = realloc(ms->m, sizeof(struct find_match) * ms->cap);
+        if(ms->m == NULL) die("realloc");
+    }
+    ms->m[ms->n].row = row;
+    ms->m[ms->n].rx = rx;
+    ms->m[ms->n].len = len;
+    ms->n++;
 }
 
-void editor_insert_row(int at, char *s, size_t len, int leading_sps)
+bool editor_search_add(struct search_chunk *c, int row, int rx, int len)
 {
-    if(at < 0 || at > E.numrows) return;
-
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for(int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+    if(c->n == MATCH_SET_MAX) return 0;
+    if(c->n == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->m = realloc(c->m, sizeof(struct find_match) * c->cap);
+        if(c->m == NULL) die("realloc");
+    }
+    c->m[c->n].row = row;
+    c->m[c->n].rx = rx;
+    c->m[c->n].len = len;
+    c->n++;
+    return 1;
+}
 
-    E.row[at].idx= at;
-    E.row[at].size = len + leading_sps;
-    E.row[at].chars = malloc(len + leading_sps + 1);
-    for(int i = 0; i < leading_sps; ++i) {
-        E.row[at].chars[i] = ' ';
+//add the matches in one line of text to chunk, returns 0 once the chunk is full.
+//with rm set the query is a regex
+bool editor_search_line(struct search_chunk *c, int row, char *chars, int size, char *query, int len,
+                        struct regex_match *rm, char **buf, int *cap)
+{
+    char *render = chars;
+    int rsize = size;
+    if(memchr(chars, '\t', size)) {
+        erow line;
+        memset(&line, 0, sizeof(line));
+        line.chars = chars;
+        line.size = size;
+        rsize = editor_row_expand(&line, buf, cap);
+        render = *buf;
     }
-    memcpy(E.row[at].chars + leading_sps, s, len);
-    E.row[at].chars[len + leading_sps] = '\0';
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editor_update_row(&E.row[at]);
-    E.numrows++;
-    if(E.options & ENABLE_LINE_NUM) {
-        editor_update_row_offset();
+    //each match is searched for past the end of the last one, as moving forwards does
+    if(rm) {
+        if(!regex_mark_starts(rm, render, rsize, 0)) return 1;
+        int at = 0, mlen;
+        while((at = regex_next(rm, render, rsize, at, &mlen)) >= 0) {
+            if(!editor_search_add(c, row, at, mlen)) return 0;
+            at += mlen;
+        }
+        return 1;
     }
-    E.dirty++;
+    char *p = render;
+    while((p = search_forward(p, render + rsize - p, query, len)) != NULL) {
+        if(!editor_search_add(c, row, p - render, len)) return 0;
+        p += len;
+    }
+    return 1;
 }
 
-void editor_free_row(erow *row)
+bool editor_search_cancelled(struct search_pool *sp, int gen)
 {
-    free(row->chars);
-    free(row->render);
-    free(row->hl);
+    pthread_mutex_lock(&sp->lock);
+    bool cancelled = sp->gen != gen;
+    pthread_mutex_unlock(&sp->lock);
+    return cancelled;
 }
 
-void editor_del_row(int at)
+//search the pieces of chunk, returns 0 if the job was cancelled meanwhile.
+//runs on the search threads, so it only reads the mapped file and the pieces
+bool editor_search_chunk(struct search_pool *sp, struct search_chunk *c, int gen)
 {
-    if(at < 0 || at >= E.numrows) return;
-    editor_free_row(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for(int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-    E.numrows--;
-    E.dirty++;
+    TRACE_SCOPE_ARG("editor_search_chunk", c - sp->chunks);
+    char *buf = NULL;
+    int cap = 0;
+    bool ok = 1;
+    char *query = sp->query;
+    int len = sp->len;
+    //the regex's matcher builds its DFAs as it goes, so every chunk has one of its own
+    struct regex_match *rm = sp->re ? regex_match_new(sp->re) : NULL;
+
+    int m, i;
+    char *needle = search_needle(query, len, sp->re, &m);
+
+    c->n = 0;
+    c->full = 0;
+    int checked = 0;
+    for(i = c->first; i < c->last && ok && !c->full; i++) {
+        struct row_piece *p = &sp->pieces[i];
+        if(p->count == 0) {
+            c->full = !editor_search_line(c, p->row, p->chars, p->size, query, len, rm, &buf, &cap);
+        } else {
+            //lines without the needle are skipped over in the mapped text
+            int line = p->line, end = p->line + p->count;
+            while(line < end) {
+                if(m > 0) {
+                    size_t start = line ? E.map.eol[line - 1] + 1 : 0;
+                    size_t stop = E.map.eol[end - 1];
+                    char *hit = search_forward(E.map.data + start, stop - start, needle, m);
+                    if(hit == NULL) break;
+                    line = editor_map_line_of(hit - E.map.data);
+                }
+                int size;
+                char *chars = editor_map_line(line, &size);
+                if(!editor_search_line(c, p->row + line - p->line, chars, size, query, len, rm, &buf, &cap)) {
+                    c->full = 1;
+                    break;
+                }
+                line++;
+                if(++checked % 256 == 0 && editor_search_cancelled(sp, gen)) {
+                    ok = 0;
+                    break;
+                }
+            }
+        }
+        if(ok && editor_search_cancelled(sp, gen)) ok = 0;
+    }
+    free(buf);
+    regex_match_free(rm);
+    return ok;
 }
 
-void editor_row_insert_char(erow *row, int at, int c)
+void *editor_search_worker(void *arg)
 {
-    if(at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2); //one for the new character, one for \0
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    
-    row->size++;
-    row->chars[at] = c;
-    editor_update_row(row);
-    E.dirty++;
+    TRACE_THREAD("search");
+    struct search_pool *sp = arg;
+    pthread_mutex_lock(&sp->lock);
+    for(;;) {
+        while(!sp->running || sp->next == sp->nchunks)
+            pthread_cond_wait(&sp->work, &sp->lock);
+        int c = sp->next++;
+        int gen = sp->gen;
+        sp->busy++;
+        pthread_mutex_unlock(&sp->lock);
+
+        bool ok = editor_search_chunk(sp, &sp->chunks[c], gen);
+
+        pthread_mutex_lock(&sp->lock);
+        sp->busy--;
+        if(ok && gen == sp->gen) sp->chunks[c].done = 1;
+        pthread_cond_broadcast(&sp->done);
+    }
+    return NULL;
 }
 
-void editor_row_append_string(erow *row, char *s, size_t len)
+//one search thread per core, started the first time a search needs them
+void editor_search_init()
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editor_update_row(row);
-    E.dirty++;
+    struct search_pool *sp = &E.search;
+    if(sp->threads) return;
+
+    pthread_mutex_init(&sp->lock, NULL);
+    pthread_cond_init(&sp->work, NULL);
+    pthread_cond_init(&sp->done, NULL);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cores < 1) cores = 1;
+    sp->threads = malloc(sizeof(pthread_t) * cores);
+    if(sp->threads == NULL) die("malloc");
+    for(sp->nthreads = 0; sp->nthreads < cores; sp->nthreads++) {
+        if(pthread_create(&sp->threads[sp->nthreads], NULL, editor_search_worker, sp) != 0)
+            break;
+        pthread_detach(sp->threads[sp->nthreads]);
+    }
 }
 
-void editor_row_del_char(erow *row, int at)
+//stop the job in progress and wait until no thread is reading the rows anymore
+void editor_search_cancel()
 {
-    if(at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editor_update_row(row);
-    E.dirty++;
+    struct search_pool *sp = &E.search;
+    if(sp->threads == NULL) return;
+    pthread_mutex_lock(&sp->lock);
+    sp->gen++;
+    sp->running = 0;
+    while(sp->busy)
+        pthread_cond_wait(&sp->done, &sp->lock);
+    pthread_mutex_unlock(&sp->lock);
+    E.matches.counting = 0;
 }
 
-/*** editor operations ***/
-
-void editor_insert_char(int c)
+void editor_search_add_piece(int row, int line, int count, char *chars, int size)
 {
-    if(E.cy == E.numrows) {
-        editor_insert_row(E.numrows, "", 0, 0);
+    struct search_pool *sp = &E.search;
+    if(sp->npieces == sp->pieces_cap) {
+        sp->pieces_cap = sp->pieces_cap ? sp->pieces_cap * 2 : 256;
+        sp->pieces = realloc(sp->pieces, sizeof(struct row_piece) * sp->pieces_cap);
+        if(sp->pieces == NULL) die("realloc");
     }
-    editor_row_insert_char(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    struct row_piece *p = &sp->pieces[sp->npieces++];
+    p->row = row;
+    p->line = line;
+    p->count = count;
+    p->chars = chars;
+    p->size = size;
 }
 
-void editor_del_char()
+void editor_search_add_chunk(int first, int last)
 {
-    //this function is like backspace
-    if(E.cy == E.numrows) return;
-    if(E.cx == 0 && E.cy == 0) return;
-
-    erow *row = &E.row[E.cy];
-    if(E.cx > 0) {
-        editor_row_del_char(row, E.cx - 1);
-        E.cx--;
-    } else {
-        E.cx = E.row[E.cy - 1].size;
-        editor_row_append_string(&E.row[E.cy - 1], row->chars, row->size);
-        editor_del_row(E.cy);
-        E.cy--;
+    struct search_pool *sp = &E.search;
+    if(sp->nchunks == sp->chunks_cap) {
+        int cap = sp->chunks_cap ? sp->chunks_cap * 2 : 64;
+        sp->chunks = realloc(sp->chunks, sizeof(struct search_chunk) * cap);
+        if(sp->chunks == NULL) die("realloc");
+        memset(&sp->chunks[sp->chunks_cap], 0, sizeof(struct search_chunk) * (cap - sp->chunks_cap));
+        sp->chunks_cap = cap;
     }
+    struct search_chunk *c = &sp->chunks[sp->nchunks++];
+    c->first = first;
+    c->last = last;
+    c->n = 0;
+    c->full = 0;
+    c->done = 0;
 }
 
-int get_leading_sps(int line) {
-    int i;
-    for(i = 0; E.row[line].render[i] == ' '; ++i);
-    return i;
+//move the finished chunks at the front of the job into the match set, in order.
+//with wait set, blocks until at least one chunk is merged or the job is over
+bool editor_search_merge(bool wait)
+{
+    struct search_pool *sp = &E.search;
+    struct match_set *ms = &E.matches;
+    bool merged = 0;
+
+    pthread_mutex_lock(&sp->lock);
+    for(;;) {
+        while(sp->merged < sp->nchunks && sp->chunks[sp->merged].done) {
+            struct search_chunk *c = &sp->chunks[sp->merged++];
+            for(int i = 0; i < c->n && !ms->more; i++) {
+                if(ms->n == MATCH_SET_MAX) ms->more = 1;
+                else editor_matches_push(c->m[i].row, c->m[i].rx, c->m[i].len);
+            }
+            if(c->full) ms->more = 1;
+            merged = 1;
+        }
+        if(merged || !wait || sp->merged == sp->nchunks || ms->more) break;
+        pthread_cond_wait(&sp->done, &sp->lock);
+    }
+    bool over = sp->merged == sp->nchunks || ms->more;
+    pthread_mutex_unlock(&sp->lock);
+
+    if(over) {
+        editor_search_cancel();
+        ms->counting = 0;
+    }
+    return merged;
 }
 
-void editor_insert_new_line() // create a new line when typeing enter
+//collect every match of query in the file. the rows are cut into chunks which the search threads
+//take one by one, a small file is searched in a single chunk right here
+void editor_matches_scan(char *query, int len)
 {
-    int leading_sps = 0;
-    if(E.options & ENABLE_AUTO_INDENT) {
-        leading_sps = get_leading_sps(E.cy);
+    struct match_set *ms = &E.matches;
+    struct search_pool *sp = &E.search;
+    editor_search_init();
+    editor_search_cancel();
+    ms->n = 0;
+    ms->more = 0;
+
+    free(sp->query);
+    sp->query = strdup(query);
+    sp->len = len;
+    sp->re = ms->re;
+    sp->npieces = 0;
+    sp->nchunks = 0;
+
+    //the pieces, with the longest runs cut where the mapped text is a chunk's worth further on
+    size_t total = E.map.len;
+    size_t chunk_bytes = total / (sp->nthreads * 8 + 1);
+    if(chunk_bytes < SEARCH_CHUNK_MIN) chunk_bytes = SEARCH_CHUNK_MIN;
+    int at = 0;
+    row_node *n;
+    for(n = row_node_first(); n; n = row_node_next(n)) {
+        if(!n->span) {
+            editor_search_add_piece(at++, 0, 0, n->row.chars, n->row.size);
+            continue;
+        }
+        int line = n->line, end = n->line + n->span;
+        while(line < end) {
+            size_t start = line ? E.map.eol[line - 1] + 1 : 0;
+            int last = editor_map_line_of(start + chunk_bytes);
+            if(last >= end) last = end - 1;
+            editor_search_add_piece(at, line, last - line + 1, NULL, 0);
+            at += last - line + 1;
+            line = last + 1;
+        }
     }
-    if(E.cx == 0) {
-        editor_insert_row(E.cy, "", 0, leading_sps);
+
+    //chunks of about chunk_bytes of text, loaded rows count for their length
+    size_t bytes = 0;
+    int first = 0;
+    for(int i = 0; i < sp->npieces; i++) {
+        struct row_piece *p = &sp->pieces[i];
+        if(p->count) {
+            size_t start = p->line ? E.map.eol[p->line - 1] + 1 : 0;
+            bytes += E.map.eol[p->line + p->count - 1] - start;
+        } else {
+            bytes += p->size + 1;
+        }
+        if(bytes >= chunk_bytes || i == sp->npieces - 1) {
+            editor_search_add_chunk(first, i + 1);
+            first = i + 1;
+            bytes = 0;
+        }
+    }
+
+    sp->next = 0;
+    sp->merged = 0;
+    if(sp->nthreads > 1 && total >= SEARCH_PARALLEL_MIN) {
+        pthread_mutex_lock(&sp->lock);
+        sp->gen++;
+        sp->running = 1;
+        pthread_cond_broadcast(&sp->work);
+        pthread_mutex_unlock(&sp->lock);
+        ms->counting = 1;
     } else {
-        erow *row = &E.row[E.cy];
-        editor_insert_row(E.cy + 1, &row->chars[E.cx], row->size - E.cx, leading_sps);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editor_update_row(row);
+        for(int i = 0; i < sp->nchunks; i++) {
+            editor_search_chunk(sp, &sp->chunks[i], sp->gen);
+            sp->chunks[i].done = 1;
+        }
+        editor_search_merge(0);
     }
-    E.cy++;
-    E.cx = leading_sps;
 }
 
-/*** file i/o ***/
-
-char *editor_rows_to_string(int *buflen) 
+//merge what the search threads found while no key is waiting, the status bar follows the count
+void editor_matches_idle()
 {
-    int totlen = 0;
-    int j;
-    for(j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1;  // /r/n is stripped off when reading from file
-    *buflen = totlen;
-
-    char *buf = malloc(totlen);
-    char *p= buf;
-    for(j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+    struct timespec last, now;
+    bool drawn = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    while(E.matches.counting && !editor_input_pending(5)) {
+        if(editor_search_merge(0)) drawn = 0;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(!drawn && (!E.matches.counting ||
+           (now.tv_sec - last.tv_sec) * 1000 + (now.tv_nsec - last.tv_nsec) / 1000000 >= 50)) {
+            editor_refresh_screen();
+            drawn = 1;
+            last = now;
+        }
     }
-
-    return buf;
 }
 
-void editor_open(char *filename) 
+//whether two matches of query can overlap, as "aa" does in "aaa"
+bool search_overlaps(const char *query, int len)
 {
-    free(E.filename);
-    E.filename = strdup(filename);
+    for(int d = 1; d < len; d++)
+        if(!memcmp(query, query + d, len - d)) return 1;
+    return 0;
+}
 
-    editor_select_syntax_highlight();
+//a query that only grew matches at a subset of the places the shorter one did,
+//so those are checked instead of the whole file
+void editor_matches_narrow(char *query, int len)
+{
+    struct match_set *ms = &E.matches;
+    int i, kept = 0, at = -1, rsize = 0, next = 0;
+    char *render = NULL;
+    for(i = 0; i < ms->n; i++) {
+        struct find_match *f = &ms->m[i];
+        if(f->row != at) {
+            at = f->row;
+            render = editor_find_render(at, &rsize);
+            next = 0;
+        }
+        //a match overlapping the one kept before it is dropped, as the scan would
+        if(f->rx >= next && f->rx + len <= rsize && !memcmp(render + f->rx, query, len)) {
+            f->len = len;
+            ms->m[kept++] = *f;
+            next = f->rx + len;
+        }
+    }
+    ms->n = kept;
+}
 
-    FILE *fp = fopen(filename, "r");
-    if(!fp) die("fopen");
+//bring the match set up to date with query
+void editor_matches_update(char *query, int len)
+{
+    struct match_set *ms = &E.matches;
+    if(ms->query && ms->len == len && !memcmp(ms->query, query, len)) return;
+
+    //the search threads may still be using the old regex
+    editor_search_cancel();
+    regex_match_free(ms->rm);
+    regex_free(ms->re);
+    ms->rm = NULL;
+    ms->re = NULL;
+    if(ms->regex) {
+        ms->re = regex_compile(query, len);
+        if(ms->re) ms->rm = regex_match_new(ms->re);
+    }
 
-    char *line = NULL;
-    //size_t: unsigned int(32)/unsigned long(64)
-    //ssize_t: int(32)/long (64)
-    size_t linecap = 0;
-    ssize_t linelen;
-    while((linelen = getline(&line, &linecap, fp)) != -1) {
-        //strip off return carriage
-        while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-            linelen--;
-        editor_insert_row(E.numrows, line, linelen, 0); // no auto indent needed
+    //the set only holds every place the old query matched if its matches can't overlap.
+    //a longer regex doesn't have to match less, so it's always searched for again
+    if(ms->regex && ms->re == NULL) {
+        ms->n = 0;
+        ms->more = 0;
+    } else if(ms->query && !ms->regex && !ms->more && !ms->counting && len > ms->len &&
+              !memcmp(ms->query, query, ms->len) && !search_overlaps(ms->query, ms->len)) {
+        editor_matches_narrow(query, len);
+    } else {
+        editor_matches_scan(query, len);
     }
-    if(E.options & ENABLE_LINE_NUM) {
-        editor_update_row_offset();
+    free(ms->query);
+    ms->query = strdup(query);
+    ms->len = len;
+    ms->current = -1;
+}
+
+void editor_matches_clear()
+{
+    struct match_set *ms = &E.matches;
+    editor_search_cancel();
+    free(ms->query);
+    ms->query = NULL;
+    regex_match_free(ms->rm);
+    regex_free(ms->re);
+    ms->rm = NULL;
+    ms->re = NULL;
+    ms->n = 0;
+    ms->more = 0;
+    ms->current = -1;
+}
+
+//the first match at or after render offset rx of row, wrapping around to the first one
+int editor_matches_after(int row, int rx)
+{
+    struct match_set *ms = &E.matches;
+    int lo = 0, hi = ms->n;
+    while(lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct find_match *f = &ms->m[mid];
+        if(f->row < row || (f->row == row && f->rx < rx)) lo = mid + 1;
+        else hi = mid;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    return lo == ms->n ? 0 : lo;
 }
 
-void editor_save() 
+//render offset of query in row, the first one from x on going forwards,
+//or the last one starting at or before x going backwards. -1 if there is none.
+//*mlen is set to the length of the match
+int editor_find_in_row(erow *row, char *query, int len, int x, int direction, int *mlen)
 {
-    if(E.filename == NULL) {
-        E.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
-        if(E.filename == NULL) {
-            editor_set_status_message("Save aborted");
-            return;
+    static char *buf = NULL;
+    static int cap = 0;
+
+    //a row that isn't on screen, or only partly, is expanded into a scratch buffer,
+    //it isn't highlighted unless it matches
+    char *render = row->render;
+    int rsize = row->rsize;
+    if(render == NULL || row->rcols) {
+        rsize = editor_row_expand(row, &buf, &cap);
+        render = buf;
+    }
+
+    struct regex_match *rm = E.matches.rm;
+    if(rm) {
+        if(direction == 1) return regex_search(rm, render, rsize, x < 0 ? 0 : x, mlen);
+        //the last of the matches going forwards through the row that starts by x
+        int at = -1, start = 0, l;
+        if(x < 0 || !regex_mark_starts(rm, render, rsize, 0)) return -1;
+        while((start = regex_next(rm, render, rsize, start, &l)) >= 0 && start <= x) {
+            at = start;
+            *mlen = l;
+            start += l;
         }
-        editor_select_syntax_highlight();
+        return at;
     }
 
-    int len;
-    char *buf = editor_rows_to_string(&len);
-    
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if(fd != -1) {
-        if(ftruncate(fd, len) != -1)  //set file size to specific length
-            if(write(fd, buf, len) == len) {
-                editor_set_status_message("%d bytes written to disk", len);
-                E.dirty = 0;
-                close(fd);
-                free(buf);
-                return;
-            }
-        close(fd);
+    char *match;
+    *mlen = len;
+    if(direction == 1) {
+        if(x < 0) x = 0;
+        if(x >= rsize) return -1;
+        match = search_forward(render + x, rsize - x, query, len);
+    } else {
+        if(x < 0) return -1;
+        match = search_backward(render, x > rsize - len ? rsize : x + len, query, len);
     }
-    
-    free(buf);
-    editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+    return match ? match - render : -1;
 }
 
-/*** find ***/
 
 void editor_find_callback(char *query, int key)
 {
+    TRACE_SCOPE("editor_find_callback");
     static int y_to_start = 0;
     static int x_to_start = 0;
     static int direction = 1;
+    static int match_len = 0;  //length of the match the cursor went to
 
     int len = strlen(query);
     int switch_direction = 0;
@@ -800,6 +4584,7 @@ void editor_find_callback(char *query, int key)
         y_to_start = E.cy;
         x_to_start = E.cx;
         direction = 1;
+        editor_matches_clear();
         return;
     } else if(key == ARROW_RIGHT || key == ARROW_DOWN) {
         if(direction == -1)
@@ -820,100 +4605,370 @@ void editor_find_callback(char *query, int key)
     }
 
     static int saved_hl_line;
+    static int saved_hl_len;
     static char* saved_hl = NULL;
 
     if(saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+        erow *row = editor_row_at(saved_hl_line);
+        //a row that left the screen or was edited gets fresh colors when it's rendered again
+        if(row->hl && row->rcols == 0 && row->rsize == saved_hl_len) memcpy(row->hl, saved_hl, row->rsize);
         free(saved_hl);
         saved_hl = NULL;
     }
+
+    struct match_set *ms = &E.matches;
+    editor_matches_update(query, len);
+    if(ms->regex && ms->re == NULL) return;
+
     int current_y = y_to_start;
-    int lines_visited = 0;
-    while(lines_visited < E.numrows) {
-        erow *row = &E.row[current_y];
-        char *match = NULL;
-        if(direction == 1) {
-            if(switch_direction) {
-                x_to_start += len << 1;
-                switch_direction = 0;
-            }
-            if(x_to_start >= row->rsize || !(match = strstr(row->render + x_to_start, query))) {
-                lines_visited++;
-                current_y += direction;
-                if(current_y == -1) current_y = E.numrows - 1;
-                else if(current_y == E.numrows) current_y = 0;
-                x_to_start = 0;
-                continue;
-            }
+    erow *row = NULL;
+    int pos = -1, mlen = len;
+    //how far before a match the next one going backwards may start. literal matches of the
+    //query don't overlap, a shorter match of a regex may be inside the last one
+    int back = ms->regex ? 1 : len;
+    bool arrow = key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP;
+    int step = (key == ARROW_LEFT || key == ARROW_UP) ? -1 : 1;
+
+    //the matches are still being counted, wait only until the one to go to is among them
+    while(ms->counting) {
+        if(arrow && ms->current >= 0) {
+            if(step == 1 ? ms->current + 1 < ms->n : ms->current > 0) break;
+        } else if(ms->n) {
+            struct find_match *f = &ms->m[ms->n - 1];
+            if(f->row > y_to_start || (f->row == y_to_start && f->rx >= x_to_start)) break;
+        }
+        editor_search_merge(1);
+    }
+
+    if(!ms->more) {
+        //with every match known, the arrows just step through them
+        if(ms->n == 0) return;
+        if(arrow && ms->current >= 0) {
+            ms->current = (ms->current + step + ms->n) % ms->n;
         } else {
-            if(switch_direction) {
-                x_to_start -= len << 1;
-                switch_direction = 0;
+            ms->current = editor_matches_after(y_to_start, x_to_start);
+        }
+        current_y = ms->m[ms->current].row;
+        pos = ms->m[ms->current].rx;
+        mlen = ms->m[ms->current].len;
+        row = editor_row_at(current_y);
+    } else {
+        //too many matches to keep, so the next one is searched for
+        if(switch_direction)
+            x_to_start += direction == 1 ? match_len + back : -(match_len + back);
+
+        //the cursor may be on the line past the end
+        if(current_y >= E.numrows) current_y = 0;
+        int lines_visited = 0;
+        while(lines_visited < E.numrows) {
+            int skip = editor_find_skip(current_y, query, len, direction, E.numrows - lines_visited);
+            if(skip == 0) {
+                row = editor_row_at(current_y);
+                pos = editor_find_in_row(row, query, len, x_to_start, direction, &mlen);
+                if(pos >= 0) break;
+                skip = 1;
             }
-            while(x_to_start >= 0 && strncmp(row->render + x_to_start, query, len))
-                x_to_start--;
-            if(x_to_start < 0) {
-                lines_visited++;
-                current_y += direction;
-                if(current_y == -1) current_y = E.numrows - 1;
-                else if(current_y == E.numrows) current_y = 0;
-                x_to_start = E.row[current_y].rsize - len;
+            lines_visited += skip;
+            current_y += direction * skip;
+            if(current_y < 0) current_y = E.numrows - 1;
+            else if(current_y >= E.numrows) current_y = 0;
+            //the next row is searched whole
+            x_to_start = direction == 1 ? 0 : INT_MAX;
+        }
+        if(pos < 0) return;
+    }
+
+    editor_row_prepare(row);
+    y_to_start = current_y;
+    x_to_start = direction == 1 ? pos + mlen : pos - back;
+    match_len = mlen;
+    E.cy = current_y;
+    E.cx = editor_row_rx_to_cx(row, pos);
+
+    saved_hl_line = current_y;
+    saved_hl_len = row->rsize;
+    saved_hl = malloc(row->rsize);
+    memcpy(saved_hl, row->hl, row->rsize);
+    memset(&row->hl[pos], HL_MATCH, mlen);
+    row->drawn = E.frame;  //keep the match colors until the row is drawn
+}
+
+void editor_find()
+{
+    editor_map_index_all();
+    E.matches.regex = 0;
+    char *query = editor_prompt("Search: %s (ESC/Arrows/Enter)", editor_find_callback);
+    
+    if(query)
+        free(query);
+}
+
+void editor_find_regex()
+{
+    editor_map_index_all();
+    E.matches.regex = 1;
+    char *query = editor_prompt("Regex: %s (ESC/Arrows/Enter)", editor_find_callback);
+
+    if(query)
+        free(query);
+}
+
+/*** append buffer ***/
+
+struct abuf {
+    char *b;
+    int len;
+    int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}  //constructor for abuf type
+
+void abAppend(struct abuf *ab, const char *s, int len)
+{
+    if(ab->len + len > ab->cap) {
+        //double the capacity, so a buffer that is reused settles at its largest size
+        int cap = ab->cap ? ab->cap : 4096;
+        while(cap < ab->len + len) cap *= 2;
+        char *new = realloc(ab->b, cap);
+        if(new == NULL) return;
+        ab->b = new;
+        ab->cap = cap;
+    }
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
+}
+
+//empty the buffer but keep its memory for the next use
+void abReset(struct abuf *ab)
+{
+    ab->len = 0;
+}
+
+//write out the whole buffer, carrying on after short writes and interruptions
+int abFlush(struct abuf *ab, int fd)
+{
+    int off = 0;
+    while(off < ab->len) {
+        ssize_t n = write(fd, ab->b + off, ab->len - off);
+        if(n == -1) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN) {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
                 continue;
             }
+            return -1;
         }
+        off += n;
+    }
+    return 0;
+}
+
+void abFree(struct abuf *ab)
+{
+    free(ab->b);
+}
+
+/*** screen ***/
 
-        y_to_start = current_y;
-        x_to_start = direction == 1 ? match - row->render + len : x_to_start - len;
-        E.cy = current_y;
-        E.cx = direction == 1 ? editor_row_rx_to_cx(row, match - row->render) : editor_row_rx_to_cx(row, x_to_start + len);
+//escape sequence selecting the attributes of each highlight class, built by screen_init
+char screen_sgr[256][16];
+int screen_sgr_len[256];
 
-        saved_hl_line = current_y;
-        saved_hl = malloc(row->rsize);
-        memcpy(saved_hl, row->hl, row->rsize);
-        memset(&row->hl[direction == 1 ? match - row->render : x_to_start + len], HL_MATCH, len);
-        return;
+void screen_free()
+{
+    free(E.screen.chars);
+    free(E.screen.hl);
+    free(E.screen.shadow_chars);
+    free(E.screen.shadow_hl);
+}
+
+//lay the editor out for a terminal of rows and cols, the next frame is drawn whole
+void editor_resize(int rows, int cols)
+{
+    screen_free();
+    screen_init(rows, cols);
+    E.screenrows = rows - 2;
+    E.screencols = cols - E.row_num_offset;
+}
+
+void screen_init(int rows, int cols)
+{
+    E.screen.rows = rows;
+    E.screen.cols = cols;
+    E.screen.chars = malloc(rows * cols);
+    E.screen.hl = malloc(rows * cols);
+    E.screen.shadow_chars = malloc(rows * cols);
+    E.screen.shadow_hl = malloc(rows * cols);
+    if(E.screen.chars == NULL || E.screen.hl == NULL ||
+       E.screen.shadow_chars == NULL || E.screen.shadow_hl == NULL) die("malloc");
+    E.screen.rowoff = 0;
+    E.screen.valid = 0;
+
+    for(int hl = 0; hl < 256; hl++) {
+        int kind = hl & ~HL_INVERSE;
+        int color = kind == HL_NORMAL ? 39 : editor_syntax_to_color(kind);
+        //7 and 27 switch reverse video on and off
+        screen_sgr_len[hl] = snprintf(screen_sgr[hl], sizeof(screen_sgr[hl]), "\x1b[%d;%dm", (hl & HL_INVERSE) ? 7 : 27, color);
     }
 }
 
-void editor_find()
+void screen_clear_line(int y)
 {
-    char *query = editor_prompt("Search: %s (ESC/Arrows/Enter)", editor_find_callback);
-    
-    if(query)
-        free(query);
+    memset(&E.screen.chars[y * E.screen.cols], ' ', E.screen.cols);
+    memset(&E.screen.hl[y * E.screen.cols], HL_NORMAL, E.screen.cols);
 }
 
-/*** append buffer ***/
+//put len characters at column x of line y, returns the column after them
+int screen_put(int y, int x, const char *s, int len, unsigned char hl)
+{
+    if(x + len > E.screen.cols) len = E.screen.cols - x;
+    memcpy(&E.screen.chars[y * E.screen.cols + x], s, len);
+    memset(&E.screen.hl[y * E.screen.cols + x], hl, len);
+    return x + len;
+}
 
-struct abuf {
-    char *b;
-    int len;
-};
+//whether line y of the frame being drawn matches line sy of the shadow
+int screen_line_same(int y, int sy)
+{
+    int cols = E.screen.cols;
+    return !memcmp(&E.screen.chars[y * cols], &E.screen.shadow_chars[sy * cols], cols) &&
+           !memcmp(&E.screen.hl[y * cols], &E.screen.shadow_hl[sy * cols], cols);
+}
 
-#define ABUF_INIT {NULL, 0}  //constructor for abuf type
+//number of lines in top..bottom-1 that would match the terminal if it scrolled up by n
+int screen_lines_matching(int top, int bottom, int n)
+{
+    int y, matching = 0;
+    for(y = top; y < bottom; y++) {
+        if(y + n < top || y + n >= bottom) continue;
+        if(screen_line_same(y, y + n)) matching++;
+    }
+    return matching;
+}
 
-void abAppend(struct abuf *ab, const char *s, int len)
+//let the terminal move lines top..bottom-1 up by n (down when n is negative) inside a
+//scrolling region, and shift the shadow the same way so only the exposed lines get drawn
+void screen_scroll(struct abuf *ab, int top, int bottom, int n)
 {
-    char *new = realloc(ab->b, ab->len + len);
+    int cols = E.screen.cols;
+    int count = n > 0 ? n : -n;
+    char buf[48];
+    //attributes are reset first so that the exposed lines are blanked with the default colors
+    int len = snprintf(buf, sizeof(buf), "\x1b[m\x1b[%d;%dr\x1b[%d%c\x1b[r", top + 1, bottom, count, n > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+
+    char *chars = &E.screen.shadow_chars[top * cols];
+    unsigned char *hl = &E.screen.shadow_hl[top * cols];
+    int kept = (bottom - top - count) * cols;
+    int blank = 0;
+    if(n > 0) {
+        memmove(chars, chars + count * cols, kept);
+        memmove(hl, hl + count * cols, kept);
+        blank = kept;
+    } else {
+        memmove(chars + count * cols, chars, kept);
+        memmove(hl + count * cols, hl, kept);
+    }
+    memset(chars + blank, ' ', count * cols);
+    memset(hl + blank, HL_NORMAL, count * cols);
+}
 
-    if(new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+void screen_move(struct abuf *ab, int y, int x)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(ab, buf, len);
 }
 
-void abFree(struct abuf *ab)
+void screen_set_attr(struct abuf *ab, int *attr, unsigned char hl)
 {
-    free(ab->b);
+    if(*attr == hl) return;
+    abAppend(ab, screen_sgr[hl], screen_sgr_len[hl]);
+    *attr = hl;
+}
+
+int screen_cell_changed(int i)
+{
+    return E.screen.chars[i] != E.screen.shadow_chars[i] || E.screen.hl[i] != E.screen.shadow_hl[i];
+}
+
+//send only the cells that differ from what the terminal shows, then remember them
+void screen_flush(struct abuf *ab)
+{
+    struct screen *scr = &E.screen;
+    int attr = -1;         //current terminal attributes, -1 when unknown
+    int cy = -1, cx = -1;  //current terminal cursor, -1 when unknown
+    int y, x, k;
+
+    if(!scr->valid) {
+        //nothing on the terminal can be trusted, make every cell differ
+        memset(scr->shadow_hl, 0xff, scr->rows * scr->cols);
+        scr->valid = 1;
+    }
+
+    for(y = 0; y < scr->rows; y++) {
+        //most lines are untouched from one frame to the next
+        if(screen_line_same(y, y)) continue;
+
+        int base = y * scr->cols;
+        char *chars = &scr->chars[base];
+        unsigned char *hl = &scr->hl[base];
+
+        //trailing blanks are erased with one sequence instead of being written out
+        int end = scr->cols;
+        while(end > 0 && chars[end - 1] == ' ' && hl[end - 1] == HL_NORMAL) end--;
+
+        x = 0;
+        while(x < end) {
+            if(!screen_cell_changed(base + x)) {
+                x++;
+                continue;
+            }
+            //rewriting a few unchanged cells is cheaper than moving the cursor over them
+            int run_end = x + 1;
+            for(k = x + 1; k < end && k - run_end <= SCREEN_MERGE_GAP; k++)
+                if(screen_cell_changed(base + k)) run_end = k + 1;
+
+            if(cy != y || cx != x) screen_move(ab, y, x);
+            //one append per stretch of equally highlighted cells
+            while(x < run_end) {
+                for(k = x + 1; k < run_end && hl[k] == hl[x]; k++);
+                screen_set_attr(ab, &attr, hl[x]);
+                abAppend(ab, &chars[x], k - x);
+                x = k;
+            }
+            cy = y;
+            cx = run_end;
+        }
+
+        char *old_chars = &scr->shadow_chars[base];
+        unsigned char *old_hl = &scr->shadow_hl[base];
+        for(x = end; x < scr->cols && old_chars[x] == ' ' && old_hl[x] == HL_NORMAL; x++);
+        if(x < scr->cols) {
+            if(cy != y || cx != end) screen_move(ab, y, end);
+            screen_set_attr(ab, &attr, HL_NORMAL);
+            abAppend(ab, "\x1b[K", 3);
+            cy = y;
+            cx = end;
+        }
+        memcpy(old_chars, chars, scr->cols);
+        memcpy(old_hl, hl, scr->cols);
+    }
+    if(attr != -1 && attr != HL_NORMAL) abAppend(ab, "\x1b[m", 3);
 }
 
 /*** output ***/
 
 void editor_scroll()
 {
+    //never let the view reach the part of the file that isn't indexed yet
+    while(editor_map_pending() && E.numrows <= (E.cy > E.rowoff ? E.cy : E.rowoff) + E.screenrows)
+        editor_map_index(MAP_INDEX_SLICE);
+
     E.rx = 0;
     if(E.cy < E.numrows)
-        E.rx = editor_row_cx_to_rx(&E.row[E.cy], E.cx);
+        E.rx = editor_row_cx_to_rx(editor_row_at(E.cy), E.cx);
 
     if(E.cy < E.rowoff) //scroll upwards
         E.rowoff = E.cy; 
@@ -923,16 +4978,22 @@ void editor_scroll()
         E.coloff = E.rx;
     if(E.rx >= E.coloff + E.screencols)
         E.coloff = E.rx - E.screencols + 1;    
+
+    //rows coming into view need the comment state of the rows above them
+    editor_syntax_catch_up(E.rowoff + E.screenrows);
 }
 
-void editor_draw_rows(struct abuf *ab)
+void editor_draw_rows()
 {
     int y;
+    editor_trim_render_cache();
+    E.frame++;
     for(y = 0; y < E.screenrows; y++) {
         //file row points to the line in the file
         //while y points to the line on the screen
         int filerow = y + E.rowoff;
 
+        screen_clear_line(y);
         if(filerow >= E.numrows) {
             if(E.numrows == 0 && y == E.screenrows / 3) { // the row for the welcome message
                 char welcome[80];
@@ -940,118 +5001,133 @@ void editor_draw_rows(struct abuf *ab)
                 if(welcomelen > E.screencols) welcomelen = E.screencols;
                 // center the welcome message
                 int padding = (E.screencols - welcomelen) / 2;
-                if(padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while(padding--) abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
+                if(padding) screen_put(y, 0, "~", 1, HL_NORMAL);
+                screen_put(y, padding, welcome, welcomelen, HL_NORMAL);
             }
             else
-                abAppend(ab, "~" , 1);
+                screen_put(y, 0, "~", 1, HL_NORMAL);
         } else {
+            int x = 0;
             if(E.options & ENABLE_LINE_NUM) {
                 char linenum[32];
                 snprintf(linenum, sizeof(linenum), "%*d ", E.row_num_offset, filerow + 1);
-                abAppend(ab, linenum, strlen(linenum));
+                x = screen_put(y, 0, linenum, strlen(linenum), HL_NORMAL);
             }
 
-            int len = E.row[filerow].rsize - E.coloff;
+            erow *row = editor_row_at(filerow);
+            editor_row_prepare_cols(row, E.coloff, E.screencols);
+            row->drawn = E.frame;
+            int off = E.coloff - row->roff;
+            int len = row->rsize - off;
             if(len < 0) len = 0;
             if(len > E.screencols) len = E.screencols;
+            if(x + len > E.screen.cols) len = E.screen.cols - x;
 
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
+            char *c = &E.screen.chars[y * E.screen.cols + x];
+            unsigned char *hl = &E.screen.hl[y * E.screen.cols + x];
+            if(len > 0) {
+                memcpy(c, &row->render[off], len);
+                memcpy(hl, &row->hl[off], len);
+            }
+            //control characters show up in reverse video as @, A, B... or ?
             int j;
             for(j = 0; j < len; j++) {
                 if(iscntrl(c[j])) {
-                    char sym = (c[j] <= 26 ? '@' + c[j] : '?');
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    //x1b[m turns off all text formatting, so need to recolor the text
-                    if(current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if(hl[j] == HL_NORMAL) {
-                    if(current_color != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);         
-                } else {
-                    int color = editor_syntax_to_color(hl[j]);
-                    if(color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
+                    c[j] = (c[j] <= 26 ? '@' + c[j] : '?');
+                    hl[j] = HL_NORMAL | HL_INVERSE;
                 }
             }
-
-
-            abAppend(ab, "\x1b[39m", 5);
         }
-        //clear each line as we redraw them instead of clearing the entire page
-        abAppend(ab, "\x1b[K", 3); 
-        abAppend(ab, "\r\n", 2);
-         
     }
+    editor_trim_render_cache();
 }
 
-void editor_draw_status_bar(struct abuf *ab)
+void editor_draw_status_bar()
 {
-    //m causes the text printed after it t be printed with various attributes
-    abAppend(ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No name]", E.numrows, E.dirty ? "(modified)" : "");
+    int y = E.screenrows;
+    char status[80], rstatus[192];
+    int len = snprintf(status, sizeof(status), "%.20s - %d%s lines %s", E.filename ? E.filename : "[No name]", E.numrows, editor_map_pending() ? "+" : "", E.dirty ? "(modified)" : "");
     if(len > E.screencols) len = E.screencols;
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft",E.cy + 1, E.numrows);
-    abAppend(ab, status, len); 
-    while(len < E.screencols + E.row_num_offset) {
-        if(E.screencols + E.row_num_offset - len == rlen) {
-            abAppend(ab, rstatus, rlen);
-            break;
-        } else {
-            abAppend(ab, " ", 1);
-            len++;
-        }
+    //while searching, where the cursor is among the matches
+    char matches[48] = "";
+    if(E.matches.query) {
+        //still counting shows as a lower bound too
+        const char *plus = E.matches.more || E.matches.counting ? "+" : "";
+        if(E.matches.regex && E.matches.re == NULL)
+            snprintf(matches, sizeof(matches), "bad regex | ");
+        else if(E.matches.current >= 0 && !E.matches.more)
+            snprintf(matches, sizeof(matches), "match %d of %d%s | ", E.matches.current + 1, E.matches.n, plus);
+        else
+            snprintf(matches, sizeof(matches), "%d%s matches | ", E.matches.n, plus);
+    }
+    if(E.save.running) {
+        int mlen = strlen(matches);
+        snprintf(matches + mlen, sizeof(matches) - mlen, "saving %d%% | ", editor_save_progress());
+    }
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d/%d", matches, E.syntax ? E.syntax->filetype : "no ft",E.cy + 1, E.numrows);
+    int width = E.screencols + E.row_num_offset;
+    //the perf overlay goes first, the file name gives way to it
+    if(E.perf.on) {
+        char perf[96];
+        int plen = perf_overlay(perf, sizeof(perf));
+        memmove(rstatus + plen + 3, rstatus, rlen + 1);
+        memcpy(rstatus, perf, plen);
+        memcpy(rstatus + plen, " | ", 3);
+        rlen += plen + 3;
+        if(len > width - rlen) len = width - rlen > 0 ? width - rlen : 0;
     }
-    abAppend(ab,"\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+
+    //the whole bar is drawn in reverse video, the right status is aligned to its end when it fits
+    screen_clear_line(y);
+    int x = screen_put(y, 0, status, len, HL_NORMAL | HL_INVERSE);
+    for(; x < width; x++)
+        screen_put(y, x, " ", 1, HL_NORMAL | HL_INVERSE);
+    if(width - len >= rlen)
+        screen_put(y, width - rlen, rstatus, rlen, HL_NORMAL | HL_INVERSE);
 }
 
-void editor_draw_message_bar(struct abuf *ab)
+void editor_draw_message_bar()
 {
-    abAppend(ab, "\x1b[K", 3);
+    int y = E.screenrows + 1;
+    screen_clear_line(y);
     int msglen = strlen(E.statusmsg);
     if(msglen > E.screencols) msglen = E.screencols;
     if(msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+        screen_put(y, 0, E.statusmsg, msglen, HL_NORMAL);
 }
 
 void editor_refresh_screen()
 {
+    TRACE_SCOPE_ARG("editor_refresh_screen", E.frame);
+    perf_push(PERF_DRAW);
     editor_scroll();
 
-    struct abuf ab = ABUF_INIT; //use buffer so that we only need to do one write(), avoiding flickering
+    editor_draw_rows();
+    editor_draw_status_bar();
+    editor_draw_message_bar();
+
+    //use buffer so that we only need to do one write(), avoiding flickering.
+    //it is kept from frame to frame, so drawing doesn't allocate once it has grown
+    static struct abuf ab = ABUF_INIT;
+    abReset(&ab);
+
+    //"?2026h" asks the terminal to hold the frame back until "?2026l", so it's never shown half drawn
+    if(E.sync_output) abAppend(&ab, "\x1b[?2026h", 8);
 
     //"?25l" hides the cursor when refreshing the screen to prevent flickering
     abAppend(&ab, "\x1b[?25l", 6);
 
+    //when the view moved by a few lines, the terminal shifts what it already shows
+    int shift = E.rowoff - E.screen.rowoff;
+    if(E.screen.valid && shift != 0 && shift > -E.screenrows && shift < E.screenrows &&
+       screen_lines_matching(0, E.screenrows, shift) > screen_lines_matching(0, E.screenrows, 0))
+        screen_scroll(&ab, 0, E.screenrows, shift);
+    E.screen.rowoff = E.rowoff;
+
+    screen_flush(&ab);
+
     //'H' positions the cursor. It takes two arguments, specifying the line and column, say "/x1b[1;1H"
     //Line and column number start at 1
-    abAppend(&ab, "\x1b[H", 3);
-    
-    editor_draw_rows(&ab);
-    editor_draw_status_bar(&ab);
-    editor_draw_message_bar(&ab);
-
     char buf[32];
     bool line_num_enabled = E.options & ENABLE_LINE_NUM;
     snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff + E.row_num_offset + (line_num_enabled != 0 ? 1 : 0)) + 1);
@@ -1059,9 +5135,13 @@ void editor_refresh_screen()
 
     //"?25h" shows the cursor after refreshing
     abAppend(&ab, "\x1b[?25h", 6);
+    if(E.sync_output) abAppend(&ab, "\x1b[?2026l", 8);
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    if(!E.headless) abFlush(&ab, STDOUT_FILENO);
+    E.frame_bytes = ab.len;
+    E.bytes_written += ab.len;
+    perf_pop();
+    perf_frame();
 }
 
 void editor_set_status_message(const char *fmt, ...)
@@ -1086,7 +5166,7 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
 
     while(1) {
         editor_set_status_message(prompt, buf);
-        editor_refresh_screen();
+        if(!editor_input_pending(0)) editor_refresh_screen();
         int c = editor_read_key();
         
         if(c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -1102,6 +5182,20 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
                 if(callback) callback(buf, c);
                 return buf;
             }
+        } else if(c == PASTE_KEY) {
+            //a prompt takes one line, the paste is cut at the first line break
+            size_t len;
+            char *text = editor_read_paste(&len);
+            for(size_t j = 0; j < len && text[j] != '\r' && text[j] != '\n'; j++) {
+                if(iscntrl(text[j]) || (unsigned char)text[j] >= 128) continue;
+                if(buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = text[j];
+                buf[buflen] = '\0';
+            }
+            free(text);
         } else if(!iscntrl(c) && c < 128) {
             if(buflen == bufsize - 1) {
                 bufsize *= 2;
@@ -1117,7 +5211,7 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
 
 void editor_move_cursor(int key)
 {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = (E.cy >= E.numrows) ? NULL : editor_row_at(E.cy);
 
     switch(key) {
         case ARROW_LEFT:
@@ -1125,7 +5219,7 @@ void editor_move_cursor(int key)
                 E.cx--;
             else if(E.cy > 0) {
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editor_row_at(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -1147,7 +5241,7 @@ void editor_move_cursor(int key)
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : editor_row_at(E.cy);
     int rowlen = row ? row->size : 0;
     if(E.cx > rowlen) {
         E.cx = rowlen;
@@ -1164,13 +5258,17 @@ void editor_process_keypress()
             break;
 
         case CTRL_KEY('q'):
+            //a save that is still running is seen through, it's what tells whether the file is dirty
+            editor_save_finish(1);
             if(E.dirty && E.quit_times > 0) {
                 editor_set_status_message("WARNING!!! File has unsaved changes. Press Ctrl-Q %d more times to quit.", E.quit_times);
                 E.quit_times--;
                 return;
             }
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
+            if(!E.headless) {
+                write(STDOUT_FILENO, "\x1b[2J", 4);
+                write(STDOUT_FILENO, "\x1b[H", 3);
+            }
             exit(0);
         break;
 
@@ -1184,13 +5282,22 @@ void editor_process_keypress()
 
         case END_KEY:
             if(E.cy < E.numrows)
-                E.cx = E.row[E.cy].size;
+                E.cx = editor_row_at(E.cy)->size;
             break;
 
         case CTRL_KEY('f'):
             editor_find();
             break;
 
+        case CTRL_KEY('r'):
+            editor_find_regex();
+            break;
+
+        case CTRL_KEY('p'):
+            perf_switch(!E.perf.on);
+            editor_set_status_message("Perf overlay %s: last/p99 us of input, edit, highlight, draw", E.perf.on ? "on" : "off");
+            break;
+
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -1220,6 +5327,15 @@ void editor_process_keypress()
             editor_move_cursor(c);
             break;
 
+        case PASTE_KEY:
+            {
+                size_t len;
+                char *text = editor_read_paste(&len);
+                editor_insert_text(text, len);
+                free(text);
+            }
+            break;
+
         case CTRL_KEY('l'):
         case '\x1b':
             break;
@@ -1230,18 +5346,688 @@ void editor_process_keypress()
     }
 }
 
-int main(int argc, char *argv[]) 
+/*** bench ***/
+
+//highlight every line of filename over and over without a terminal and report the throughput,
+//run as "kilo --bench-syntax file.c"
+void editor_bench_syntax(char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if(!fp) die("fopen");
+    E.KILO_TAB_STOP = 8;
+    E.filename = filename;
+    init_separators();
+    editor_select_syntax_highlight();
+    if(E.syntax == NULL) {
+        fprintf(stderr, "no syntax for %s\n", filename);
+        exit(1);
+    }
+
+    erow *rows = NULL;
+    int nrows = 0, cap = 0;
+    long bytes = 0;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while((linelen = getline(&line, &linecap, fp)) != -1) {
+        while(linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            linelen--;
+        if(nrows == cap) {
+            cap = cap ? cap * 2 : 1024;
+            rows = realloc(rows, sizeof(erow) * cap);
+            if(rows == NULL) die("realloc");
+        }
+        erow *row = &rows[nrows++];
+        memset(row, 0, sizeof(erow));
+        row->chars = malloc(linelen + 1);
+        memcpy(row->chars, line, linelen);
+        row->chars[linelen] = '\0';
+        row->size = linelen;
+        bytes += linelen;
+    }
+    free(line);
+    fclose(fp);
+
+    char *render = NULL;
+    unsigned char *hl = NULL;
+    int rcap = 0, hlcap = 0;
+    long done = 0;
+    int passes = 0;
+    struct timespec start, now;
+    double elapsed;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        bool in_comment = 0;
+        for(int j = 0; j < nrows; j++) {
+            int rsize = editor_row_expand(&rows[j], &render, &rcap);
+            if(hlcap < rcap) {
+                hl = realloc(hl, rcap);
+                if(hl == NULL) die("realloc");
+                hlcap = rcap;
+            }
+            in_comment = editor_syntax_scan(render, rsize, hl, in_comment);
+        }
+        done += bytes;
+        passes++;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    } while(elapsed < 2.0);
+
+    printf("%s: %d rows, %ld bytes, %d passes in %.2fs, %.1f MB/s\n",
+           filename, nrows, bytes, passes, elapsed, done / elapsed / 1e6);
+    exit(0);
+}
+
+//one kind of operation, with how long each time it was done took
+struct bench_op {
+    const char *name;
+    double *us;
+    int n;
+    int cap;
+    unsigned long allocs;
+    int frames;         //frames drawn for it
+    long frame_bytes;
+};
+
+//a step of the script: a key handed to the editor, or with keys NULL, a wait for the
+//background work (indexing, counting matches, saving) to be done
+struct bench_step {
+    const char *name;
+    char *keys;
+};
+
+//a key of a replay that took long, to find it again in the log
+struct bench_slow {
+    long seq;
+    int key;
+    double us;
+    int frame_bytes;
+};
+
+//what the editor runs on when there's no terminal: the script of the bench, or a recorded
+//session being replayed
+struct bench {
+    char *path;  //the generated file
+    long size;
+    int rows, cols;  //of the screen, bars included
+    struct bench_step *steps;
+    int nsteps;
+    int cap;
+    int next;  //step to hand out next
+    const char *step;  //op of the last key handed out
+    struct bench_op ops[BENCH_OPS];
+    int nops;
+    int cur;   //op of the key being worked on, -1 once it's done
+    struct timespec start;
+    unsigned long allocs;
+    unsigned int frame;  //E.frame when the key was taken
+
+    char *log;            //the session being replayed, NULL for the bench
+    FILE *replay;
+    bool realtime;        //keys are handed out as far apart as they were read
+    struct timespec due;  //when the record being held back was read, in a real time replay
+    int tag;              //record being held back, 0 if none
+    unsigned long delta;
+    char *keys;
+    int nkeys;
+    int keys_cap;
+    long seq;             //keys taken so far
+    int key;              //the key being worked on
+    struct bench_slow slow[BENCH_SLOWEST];
+    int nslow;
+};
+
+struct bench bench;
+
+double bench_elapsed_us(struct timespec *from)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) * 1e6 + (now.tv_nsec - from->tv_nsec) / 1e3;
+}
+
+int bench_op(const char *name)
+{
+    for(int i = 0; i < bench.nops; i++)
+        if(!strcmp(bench.ops[i].name, name)) return i;
+    if(bench.nops == BENCH_OPS) die("bench ops");
+    bench.ops[bench.nops].name = name;
+    return bench.nops++;
+}
+
+void bench_begin(const char *name)
+{
+    bench.cur = bench_op(name);
+    bench.allocs = alloc_count;
+    bench.frame = E.frame;
+    clock_gettime(CLOCK_MONOTONIC, &bench.start);
+}
+
+//keep the BENCH_SLOWEST slowest keys of a replay, slowest first
+void bench_note_slow(int key, double us, int frame_bytes)
+{
+    int i = bench.nslow < BENCH_SLOWEST ? bench.nslow++ : BENCH_SLOWEST;
+    while(i > 0 && bench.slow[i - 1].us < us) {
+        if(i < BENCH_SLOWEST) bench.slow[i] = bench.slow[i - 1];
+        i--;
+    }
+    if(i < BENCH_SLOWEST)
+        bench.slow[i] = (struct bench_slow){bench.seq, key, us, frame_bytes};
+}
+
+void bench_end()
+{
+    if(bench.cur < 0) return;
+    struct bench_op *op = &bench.ops[bench.cur];
+    if(op->n == op->cap) {
+        op->cap = op->cap ? op->cap * 2 : 64;
+        op->us = realloc(op->us, sizeof(double) * op->cap);
+        if(op->us == NULL) die("realloc");
+    }
+    double us = bench_elapsed_us(&bench.start);
+    op->us[op->n++] = us;
+    op->allocs += alloc_count - bench.allocs;
+    int frame_bytes = 0;
+    if(E.frame != bench.frame) {
+        frame_bytes = E.frame_bytes;
+        op->frames++;
+        op->frame_bytes += frame_bytes;
+    }
+    if(bench.log) bench_note_slow(bench.key, us, frame_bytes);
+    bench.cur = -1;
+}
+
+void bench_add(const char *name, const char *keys)
+{
+    if(bench.nsteps == bench.cap) {
+        bench.cap = bench.cap ? bench.cap * 2 : 256;
+        bench.steps = realloc(bench.steps, sizeof(struct bench_step) * bench.cap);
+        if(bench.steps == NULL) die("realloc");
+    }
+    bench.steps[bench.nsteps].name = name;
+    bench.steps[bench.nsteps].keys = keys ? strdup(keys) : NULL;
+    bench.nsteps++;
+}
+
+//each character of text as a step of its own
+void bench_type(const char *name, const char *text)
+{
+    char key[2] = "";
+    for(; *text; text++) {
+        key[0] = *text;
+        bench_add(name, key);
+    }
+}
+
+int bench_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+//what a key of a replay is counted as
+const char *bench_key_kind(int key)
+{
+    switch(key) {
+        case '\r': return "enter";
+        case BACKSPACE: case CTRL_KEY('h'): case DEL_KEY: return "delete";
+        case ARROW_UP: case ARROW_DOWN: case ARROW_LEFT: case ARROW_RIGHT:
+        case HOME_KEY: case END_KEY: return "cursor";
+        case PAGE_UP: case PAGE_DOWN: return "page";
+        case PASTE_KEY: return "paste";
+    }
+    return key < 128 && !iscntrl(key) ? "type" : "command";
+}
+
+void editor_bench_report()
+{
+    bench_end();
+    if(bench.log) {
+        printf("replay of %s: %ld keys, %u frames, %ld bytes drawn\n", bench.log, bench.seq, E.frame, E.bytes_written);
+    } else {
+        //saving maps the file afresh, its lines are counted again
+        editor_map_index_all();
+        printf("%.1f MiB, %d lines, %dx%d screen, %u frames, %ld bytes drawn\n",
+               bench.size / (double)(1 << 20), E.numrows, bench.rows, bench.cols, E.frame, E.bytes_written);
+    }
+    printf("%-14s %6s %10s %10s %10s %10s %12s %10s\n", "op", "runs", "p50 us", "p90 us", "p99 us", "max us", "allocs/run", "B/frame");
+    for(int i = 0; i < bench.nops; i++) {
+        struct bench_op *op = &bench.ops[i];
+        if(op->n == 0) continue;
+        qsort(op->us, op->n, sizeof(double), bench_cmp);
+        char allocs[32] = "-";
+        if(ALLOCS_COUNTED) snprintf(allocs, sizeof(allocs), "%.1f", (double)op->allocs / op->n);
+        printf("%-14s %6d %10.0f %10.0f %10.0f %10.0f %12s %10.0f\n", op->name, op->n,
+               op->us[op->n / 2], op->us[op->n * 9 / 10], op->us[op->n * 99 / 100],
+               op->us[op->n - 1], allocs, op->frames ? (double)op->frame_bytes / op->frames : 0.0);
+    }
+    if(bench.nslow) {
+        printf("slowest keys:\n%8s %8s %10s %10s\n", "#", "key", "us", "frame B");
+        for(int i = 0; i < bench.nslow; i++)
+            printf("%8ld %8d %10.0f %10d\n", bench.slow[i].seq, bench.slow[i].key, bench.slow[i].us, bench.slow[i].frame_bytes);
+    }
+    if(bench.path) unlink(bench.path);
+}
+
+//the editor took a key and is about to work on it
+void editor_bench_key_start(int key)
+{
+    bench.seq++;
+    bench.key = key;
+    bench_begin(bench.log ? bench_key_kind(key) : bench.step);
+}
+
+//the editor is about to wait for a key, so the one it was given is done with, frame included
+void editor_bench_key_done()
+{
+    bench_end();
+}
+
+int key_log_put(char *p, unsigned long v)
+{
+    int n = 0;
+    for(; v >= 0x80; v >>= 7)
+        p[n++] = (v & 0x7f) | 0x80;
+    p[n++] = v;
+    return n;
+}
+
+bool key_log_get(FILE *fp, unsigned long *v)
+{
+    int c, shift = 0;
+    *v = 0;
+    do {
+        if((c = fgetc(fp)) == EOF || shift > 56) return 0;
+        *v |= (unsigned long)(c & 0x7f) << shift;
+        shift += 7;
+    } while(c & 0x80);
+    return 1;
+}
+
+void bench_bad_log()
+{
+    fprintf(stderr, "%s is not a key log, or it's cut short\n", bench.log);
+    editor_save_finish(1);
+    exit(1);
+}
+
+//read the next record of the log being replayed, tag is left 0 at its end
+void bench_read_record()
+{
+    FILE *fp = bench.replay;
+    unsigned long a, b = 0;
+    int tag = fgetc(fp);
+    bench.tag = 0;
+    if(tag == EOF) return;
+    if(!key_log_get(fp, &bench.delta) || !key_log_get(fp, &a)) bench_bad_log();
+    if(tag == 'k') {
+        if(a == 0 || a > INPUT_BUF_SIZE) bench_bad_log();
+        if(bench.keys_cap < (int)a) {
+            bench.keys = realloc(bench.keys, a);
+            if(bench.keys == NULL) die("realloc");
+            bench.keys_cap = a;
+        }
+        if(fread(bench.keys, 1, a, fp) != a) bench_bad_log();
+        bench.nkeys = a;
+    } else if(tag == 'w') {
+        if(!key_log_get(fp, &b) || a < 3 || b < 20) bench_bad_log();
+        bench.rows = a;
+        bench.cols = b;
+    } else {
+        bench_bad_log();
+    }
+    bench.tag = tag;
+
+    //in a real time replay it's due as long after the record before as it was read then
+    bench.due.tv_sec += bench.delta / 1000;
+    bench.due.tv_nsec += (bench.delta % 1000) * 1000000;
+    if(bench.due.tv_nsec >= 1000000000) {
+        bench.due.tv_sec++;
+        bench.due.tv_nsec -= 1000000000;
+    }
+}
+
+//ms until the record held back is due
+double bench_due_in()
+{
+    return -bench_elapsed_us(&bench.due) / 1e3;
+}
+
+//hand the editor the next keys of the log. keys the decoder gives a short while to arrive,
+//the rest of an escape sequence, only come if they came that soon in the session. returns 0
+//if nothing is handed out, the end of the log ends the replay
+bool editor_replay_feed(struct input_buf *in, int timeout)
+{
+    while(1) {
+        if(bench.tag == 0) bench_read_record();
+        if(bench.tag == 0) {
+            if(timeout != -1) return 0;
+            //like quitting, a save the log ended on is seen through
+            editor_save_finish(1);
+            exit(0);
+        }
+        if(timeout != -1 && (bench.tag != 'k' || bench.delta > (unsigned long)timeout)) return 0;
+
+        double wait;
+        while(bench.realtime && (wait = bench_due_in()) > 0)
+            poll(NULL, 0, wait + 1);
+
+        if(bench.tag == 'w') {
+            bench.tag = 0;
+            editor_resize(bench.rows, bench.cols);
+            editor_refresh_screen();
+            continue;
+        }
+
+        //keys that were read into a buffer holding more than this one does come in two goes
+        int room = INPUT_BUF_SIZE - in->len;
+        int n = bench.nkeys < room ? bench.nkeys : room;
+        memcpy(in->buf + in->len, bench.keys, n);
+        in->len += n;
+        memmove(bench.keys, bench.keys + n, bench.nkeys - n);
+        bench.nkeys -= n;
+        if(bench.nkeys == 0) bench.tag = 0;
+        else bench.delta = 0;
+        return 1;
+    }
+}
+
+//hand the editor the next key. the bench's script only hands one out when the editor is
+//waiting for it, and runs the waits in between with the editor's own idle work
+bool editor_bench_feed(struct input_buf *in, int timeout)
+{
+    if(bench.log) return editor_replay_feed(in, timeout);
+    if(timeout != -1) return 0;
+
+    while(bench.next < bench.nsteps) {
+        struct bench_step *step = &bench.steps[bench.next++];
+        if(step->keys == NULL) {
+            bench_begin(step->name);
+            editor_map_index_idle();
+            editor_syntax_idle();
+            editor_matches_idle();
+            editor_save_idle();
+            bench_end();
+            continue;
+        }
+        int len = strlen(step->keys);
+        memcpy(in->buf + in->len, step->keys, len);
+        in->len += len;
+        bench.step = step->name;
+        return 1;
+    }
+    editor_save_finish(1);
+    exit(0);
+}
+
+//whether a key is waiting, when the input buffer is empty. in a real time replay that's
+//the next record being due, otherwise keys are handed out when asked for
+bool editor_bench_pending(int timeout)
+{
+    if(bench.log && bench.realtime) {
+        if(bench.tag == 0) bench_read_record();
+        if(bench.tag == 0) return 0;
+        double wait = bench_due_in();
+        if(wait > 0 && timeout > 0) {
+            poll(NULL, 0, wait < timeout ? wait + 1 : timeout);
+            wait = bench_due_in();
+        }
+        return wait <= 0;
+    }
+    //what's waited for is the background work, checked on every millisecond
+    if(timeout > 0) poll(NULL, 0, 1);
+    return 0;
+}
+
+//whether the editor's idle work runs between keys, as with a terminal. the bench and a fast
+//replay leave it out of the time the keys take
+bool editor_bench_idles()
+{
+    return !E.headless || (bench.log && bench.realtime);
+}
+
+//replay a session recorded with --record, as fast as it goes or with --realtime as far
+//apart as the keys were read, and report how long each kind of key took.
+//run as "kilo --replay session.keys [file] [--realtime]"
+void editor_replay_start(char *log, char *filename, bool realtime)
+{
+    char magic[sizeof(KEY_LOG_MAGIC) - 1];
+    bench.log = log;
+    bench.realtime = realtime;
+    bench.replay = fopen(log, "rb");
+    if(bench.replay == NULL) die("fopen");
+    if(fread(magic, 1, sizeof(magic), bench.replay) != sizeof(magic) ||
+       memcmp(magic, KEY_LOG_MAGIC, sizeof(magic)))
+        bench_bad_log();
+    //the log starts with the size of the terminal
+    bench_read_record();
+    if(bench.tag != 'w') bench_bad_log();
+    bench.tag = 0;
+
+    E.headless = 1;
+    E.screenrows = bench.rows;
+    E.screencols = bench.cols;
+    init_editor();
+    bench.cur = -1;
+    clock_gettime(CLOCK_MONOTONIC, &bench.due);
+    if(filename) editor_open(filename);
+    atexit(editor_bench_report);
+}
+
+//a session being recorded: the magic, then a record for each read of keys and each resize,
+//a tag with the ms since the record before, then the keys or the new size. numbers are varints
+struct key_log {
+    int fd;
+    struct timespec last;
+};
+
+struct key_log key_log;
+
+void key_log_write(int tag, unsigned long a, unsigned long b, char *keys)
+{
+    char buf[INPUT_BUF_SIZE + 32];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long delta = (now.tv_sec - key_log.last.tv_sec) * 1000 + (now.tv_nsec - key_log.last.tv_nsec) / 1000000;
+    key_log.last = now;
+
+    int n = 0;
+    buf[n++] = tag;
+    n += key_log_put(buf + n, delta);
+    n += key_log_put(buf + n, a);
+    if(tag == 'w') n += key_log_put(buf + n, b);
+    if(keys) {
+        memcpy(buf + n, keys, a);
+        n += a;
+    }
+    if(write(key_log.fd, buf, n) != n) {
+        E.recording = 0;
+        editor_set_status_message("Recording stopped: %s", strerror(errno));
+    }
+}
+
+void editor_record_keys(char *keys, int len)
+{
+    key_log_write('k', len, 0, keys);
+}
+
+void editor_record_resize(int rows, int cols)
 {
-    enable_raw_mode();
+    key_log_write('w', rows, cols, NULL);
+}
+
+//log the keys of this session to path, for --replay. run as "kilo --record session.keys [file]"
+void editor_record_start(char *path)
+{
+    key_log.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(key_log.fd == -1) die("open");
+    if(write(key_log.fd, KEY_LOG_MAGIC, sizeof(KEY_LOG_MAGIC) - 1) != sizeof(KEY_LOG_MAGIC) - 1) die("write");
+    clock_gettime(CLOCK_MONOTONIC, &key_log.last);
+    E.recording = 1;
+    editor_record_resize(E.screen.rows, E.screen.cols);
+}
+
+//write about size bytes of C, a comment or a string here and there, with the word needle
+//on one line in a thousand for the searches to find
+void editor_bench_corpus(char *path, long size)
+{
+    FILE *fp = fopen(path, "w");
+    if(!fp) die("fopen");
+    static char buf[1 << 20];
+    setvbuf(fp, buf, _IOFBF, sizeof(buf));
+    long written = 0;
+    for(long i = 0; written < size; i++) {
+        int n;
+        switch(i % 8) {
+            case 0: n = fprintf(fp, "int value_%ld = %ld;  // counter %ld\n", i, i * 7, i); break;
+            case 1: n = fprintf(fp, "\tif(value_%ld > %ld) return \"string %ld\";\n", i, i % 97, i); break;
+            case 2: n = fprintf(fp, "/* a comment that runs on\n"); break;
+            case 3: n = fprintf(fp, " * over two lines, %ld */\n", i); break;
+            case 4: n = fprintf(fp, "static double ratio_%ld = %ld.5;\n", i, i % 13); break;
+            case 5: n = fprintf(fp, "\twhile(count < %ld) count += step;\n", i % 1000); break;
+            case 6: n = fprintf(fp, "\n"); break;
+            default:
+                if(i % 1000 == 7) n = fprintf(fp, "char *name_%ld = \"needle_%ld\";\n", i, i);
+                else n = fprintf(fp, "void function_%ld(void) { return; }\n", i);
+        }
+        written += n;
+    }
+    if(fclose(fp) != 0) die("fclose");
+}
+
+//run the editor without a terminal over a generated file of size bytes (a number with K, M
+//or G after it), playing a script of keys against a screen of the given size, and report how
+//long each kind of key took. run as "kilo --bench 16M [50x200]"
+void editor_bench_start(char *size, char *screen)
+{
+    //K, M and G are powers of 1024, as the report gives the size
+    char *end;
+    double n = strtod(size, &end);
+    switch(toupper(*end)) {
+        case 'G': n *= 1024;  /* fall through */
+        case 'M': n *= 1024;  /* fall through */
+        case 'K': n *= 1024;
+    }
+    bench.size = n;
+    bench.rows = 50;
+    bench.cols = 200;
+    if(screen && sscanf(screen, "%dx%d", &bench.rows, &bench.cols) != 2) {
+        fprintf(stderr, "screen size is ROWSxCOLS, not %s\n", screen);
+        exit(1);
+    }
+    if(bench.size <= 0 || bench.rows < 3 || bench.cols < 20) {
+        fprintf(stderr, "usage: kilo --bench SIZE[K|M|G] [ROWSxCOLS]\n");
+        exit(1);
+    }
+
+    char *tmp = getenv("TMPDIR");
+    bench.path = malloc(PATH_MAX);
+    snprintf(bench.path, PATH_MAX, "%s/kilo-bench-XXXXXX.c", tmp ? tmp : "/tmp");
+    int fd = mkstemps(bench.path, 2);
+    if(fd == -1) die("mkstemps");
+    close(fd);
+    editor_bench_corpus(bench.path, bench.size);
+
+    E.headless = 1;
+    E.screenrows = bench.rows;
+    E.screencols = bench.cols;
     init_editor();
-    if(argc >= 2)
-        editor_open(argv[1]);
+    bench.cur = -1;
+    atexit(editor_bench_report);
+
+    bench_begin("open");
+    editor_open(bench.path);
+    editor_refresh_screen();
+    bench_end();
+    bench_add("index", NULL);
+
+    for(int i = 0; i < 500; i++) bench_add("page down", "\x1b[6~");
+    for(int i = 0; i < 250; i++) bench_add("page up", "\x1b[5~");
+    for(int i = 0; i < 100; i++) bench_add("cursor", i % 2 ? "\x1b[B" : "\x1b[C");
+
+    for(int i = 0; i < 40; i++) {
+        bench_type("type", "int typed = 42;  // typed in");
+        bench_add("newline", "\r");
+    }
+    for(int i = 0; i < 200; i++) bench_add("delete", "\x7f");
+    bench_add("highlight", NULL);
+
+    bench_add("find", "\x06");
+    bench_type("find key", "needle");
+    bench_add("find count", NULL);
+    for(int i = 0; i < 20; i++) bench_add("find next", "\x1b[B");
+    bench_add("find accept", "\r");
+
+    bench_add("regex", "\x12");
+    bench_type("regex key", "ne+dle_[0-9]+");
+    bench_add("regex count", NULL);
+    for(int i = 0; i < 20; i++) bench_add("regex next", "\x1b[B");
+    bench_add("regex accept", "\r");
+
+    bench_add("save", "\x13");
+    bench_add("save write", NULL);
+}
+
+/*** main ***/
+
+//an option left without its argument would otherwise be opened as the file to edit
+void editor_check_args(int argc, char *argv[])
+{
+    static const char *usage[][2] = {
+        {"--bench", "SIZE[K|M|G] [ROWSxCOLS]"},
+        {"--bench-syntax", "FILE"},
+        {"--record", "LOG [FILE]"},
+        {"--replay", "LOG [FILE] [--realtime]"},
+    };
+    if(argc != 2) return;
+    for(size_t i = 0; i < sizeof(usage) / sizeof(usage[0]); i++) {
+        if(!strcmp(argv[1], usage[i][0])) {
+            fprintf(stderr, "usage: kilo %s %s\n", usage[i][0], usage[i][1]);
+            exit(1);
+        }
+    }
+}
 
-    editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+int main(int argc, char *argv[]) 
+{
+    TRACE_INIT();
+    editor_check_args(argc, argv);
+    if(argc == 3 && !strcmp(argv[1], "--bench-syntax"))
+        editor_bench_syntax(argv[2]);
+
+    if(argc >= 3 && !strcmp(argv[1], "--bench")) {
+        editor_bench_start(argv[2], argc >= 4 ? argv[3] : NULL);
+    } else if(argc >= 3 && !strcmp(argv[1], "--replay")) {
+        char *filename = NULL;
+        bool realtime = 0;
+        for(int i = 3; i < argc; i++) {
+            if(!strcmp(argv[i], "--realtime")) realtime = 1;
+            else filename = argv[i];
+        }
+        editor_replay_start(argv[2], filename, realtime);
+    } else {
+        char *filename = argc >= 2 ? argv[1] : NULL;
+        enable_raw_mode();
+        init_editor();
+        atexit(perf_dump);
+        if(argc >= 3 && !strcmp(argv[1], "--record")) {
+            editor_record_start(argv[2]);
+            filename = argc >= 4 ? argv[3] : NULL;
+        }
+        if(filename)
+            editor_open(filename);
+    }
 
+    editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-R = regex");
+
+    //keys that came in together are all applied before the screen is drawn again. the view
+    //still follows the cursor after each one, for the keys that move by it, like page down
     while(1) {
-        editor_refresh_screen();
+        if(!editor_input_pending(0)) editor_refresh_screen();
+        perf_push(PERF_EDIT);
         editor_process_keypress();
+        editor_scroll();
+        perf_pop();
     }
 
     return 0;